@@ -0,0 +1,641 @@
+#ifndef __COMPILED_MOBILE_H
+#define __COMPILED_MOBILE_H
+
+#include "Mobile.h"
+#include "../Common/Model.h"
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace simference
+{
+	// A Mobile flattened into structure-of-arrays form, compiled once per structure.
+	// Strings, rods and weights are each stored contiguously in topological (pre-)order and refer to
+	// one another, and to the structure's parameter vector, by index, so evaluating the mobile is a
+	// handful of flat loops instead of a virtual walk over the component tree.
+	// The mobile is planar (every offset from the root anchor lies in x/y), so only x and y are stored.
+	template<typename RealNum>
+	class CompiledMobile
+	{
+	public:
+		typedef typename Mobile<RealNum>::CollisionSummary CollisionSummary;
+
+		CompiledMobile(const String<stan::agrad::var>::type& derivation, const Eigen::Vector3d& anchor);
+
+		// Reads the parameters, propagates anchors down from the root and aggregates
+		// subtree masses up from the leaves. Must be called before the queries below.
+		void update(const ParameterVector<RealNum>& params);
+
+		// With 'broadPhase' set, candidate pairs whose bounding boxes don't overlap are pruned (by sweep and prune)
+		// before the narrow phase. Those pairs contribute exactly zero, and the rest are accumulated in the same
+		// order, so the totals and their gradients are identical either way.
+		CollisionSummary checkStaticCollisions(bool broadPhase = false) const;
+		RealNum softMaxTorqueNorm() const;
+
+		// Reverse mode in double, one block of terms at a time, so that no tape is needed: the *Adjoints
+		// methods add the gradients of their terms w.r.t. the per-evaluation state (at its current values)
+		// into 'adj', and backpropagate carries those back through update to the parameters.
+		class Adjoints
+		{
+		public:
+			std::vector<double> stringLength, stringX, stringY, stringMass;
+			std::vector<double> rodLength, rodConnect, rodStartX, rodY;
+			std::vector<double> weightRadius, weightX, weightY;
+		};
+		void clearAdjoints(Adjoints& adj) const;
+		// weights[t] scales the gradient of the total of collision type t
+		void collisionAdjoints(const double* weights, bool broadPhase, Adjoints& adj) const;
+		void torqueAdjoints(double weight, Adjoints& adj) const;
+		// Adds to 'gradient' (one entry per parameter)
+		void backpropagate(const ParameterVector<double>& params, const Adjoints& adj, double* gradient) const;
+
+		unsigned int numStrings() const { return stringParam.size(); }
+		unsigned int numRods() const { return rodParam.size(); }
+		unsigned int numWeights() const { return weightParam.size(); }
+
+	private:
+		enum { None = -1 };
+
+		// Pre-order extent [first, last) of a component's subtree
+		class Span
+		{
+		public:
+			Span() : first(0), last(0) {}
+			bool isAncestorOf(const Span& other) const { return first < other.first && other.last <= last; }
+			unsigned int first, last;
+		};
+
+		// Index pairs (into the arrays of the two kinds involved), stored as two parallel lists
+		class IndexPairs
+		{
+		public:
+			void add(unsigned int i, unsigned int j) { first.push_back(i); second.push_back(j); }
+			void clear() { first.clear(); second.clear(); }
+			unsigned int size() const { return first.size(); }
+			std::vector<unsigned int> first, second;
+		};
+
+		enum Kind { StringKind = 0, RodKind, WeightKind };
+
+		// Axis-aligned bounds of a component, for the broad phase
+		class Box
+		{
+		public:
+			double xmin, xmax, ymin, ymax;
+			Kind kind;
+			unsigned int index;
+		};
+
+		typedef typename Mobile<RealNum>::CollisionType CollisionType;
+		static const unsigned int NumCollisionTypes = Mobile<RealNum>::NumCollisionTypes;
+
+		bool eligible(CollisionType type, unsigned int i, unsigned int j) const;
+		void sweepAndPrune() const;
+		void narrowPhase(const IndexPairs* pairs, CollisionSummary& summary) const;
+
+		// Kept as plain doubles: a RealNum built once here would outlive the tape it was put on
+		double rootX, rootY;
+
+		// Structure: parameter indices, links, and subtree extents
+		std::vector<unsigned int> stringParam;
+		std::vector<int> stringParentRod;		// None for the root string
+		std::vector<unsigned int> stringSide;	// 0 = hangs from the left end of its rod, 1 = right
+		std::vector<int> stringChildRod;		// None if the string ends in a weight
+		std::vector<int> stringChildWeight;		// None if the string ends in a rod
+		std::vector<Span> stringSpan;
+		std::vector<unsigned int> rodParam;
+		std::vector<unsigned int> rodParentString;
+		std::vector<unsigned int> rodLeftString;
+		std::vector<unsigned int> rodRightString;
+		std::vector<Span> rodSpan;
+		std::vector<unsigned int> weightParam;
+		std::vector<unsigned int> weightParentString;
+		std::vector<Span> weightSpan;
+
+		// Pairs eligible to collide, by type (fixed for the structure), in lexicographic order
+		IndexPairs candidatePairs[NumCollisionTypes];
+
+		// Per-evaluation state, filled in by update
+		std::vector<RealNum> stringLength, stringX, stringY, stringMass;
+		std::vector<RealNum> rodLength, rodConnect, rodStartX, rodY;
+		std::vector<RealNum> weightRadius, weightX, weightY;
+
+		// Broad phase scratch space
+		mutable std::vector<Box> boxes;
+		mutable std::vector<std::pair<unsigned int, unsigned int>> overlaps[NumCollisionTypes];
+		mutable IndexPairs overlappingPairs[NumCollisionTypes];
+	};
+
+
+	//////////////////// Implementation ///////////////////////////////
+
+
+	template<typename RealNum>
+	CompiledMobile<RealNum>::CompiledMobile(const String<stan::agrad::var>::type& derivation, const Eigen::Vector3d& anchor)
+		: rootX(anchor.x()), rootY(anchor.y())
+	{
+		// The derivation lists the components in pre-order (see Mobile::Mobile), and the
+		// parameter vector lists their parameters in that same order.
+		unsigned int next = 0, pindex = 0;
+		function<void(int, unsigned int)> helper = [&](int parentRod, unsigned int side)
+		{
+			unsigned int s = stringParam.size();
+			auto head = derivation[next++];
+			if (!head->is<StringTerminal<stan::agrad::var>>())
+				throw "CompiledMobile::CompiledMobile - Malformed input string!";
+			stringParam.push_back(pindex); pindex += head->numParams();
+			stringParentRod.push_back(parentRod);
+			stringSide.push_back(side);
+			stringChildRod.push_back(None);
+			stringChildWeight.push_back(None);
+			stringSpan.push_back(Span());
+			stringSpan[s].first = next - 1;
+
+			head = derivation[next++];
+			if (head->is<WeightTerminal<stan::agrad::var>>())
+			{
+				stringChildWeight[s] = weightParam.size();
+				weightParam.push_back(pindex); pindex += head->numParams();
+				weightParentString.push_back(s);
+				weightSpan.push_back(Span());
+				weightSpan.back().first = next - 1;
+				weightSpan.back().last = next;
+			}
+			else if (head->is<RodTerminal<stan::agrad::var>>())
+			{
+				unsigned int r = rodParam.size();
+				stringChildRod[s] = r;
+				rodParam.push_back(pindex); pindex += head->numParams();
+				rodParentString.push_back(s);
+				rodLeftString.push_back(0);
+				rodRightString.push_back(0);
+				rodSpan.push_back(Span());
+				rodSpan[r].first = next - 1;
+				rodLeftString[r] = stringParam.size();
+				helper(r, 0);
+				rodRightString[r] = stringParam.size();
+				helper(r, 1);
+				rodSpan[r].last = next;
+			}
+			else throw "CompiledMobile::CompiledMobile - Malformed input string!";
+
+			stringSpan[s].last = next;
+		};
+		helper(None, 0);
+
+		stringLength.resize(numStrings()); stringX.resize(numStrings()); stringY.resize(numStrings()); stringMass.resize(numStrings());
+		rodLength.resize(numRods()); rodConnect.resize(numRods()); rodStartX.resize(numRods()); rodY.resize(numRods());
+		weightRadius.resize(numWeights()); weightX.resize(numWeights()); weightY.resize(numWeights());
+
+		unsigned int ns = numStrings(), nr = numRods(), nw = numWeights();
+		for (unsigned int i = 0; i < nr; i++) for (unsigned int j = i+1; j < nr; j++)
+			if (eligible(Mobile<RealNum>::RodXRod, i, j)) candidatePairs[Mobile<RealNum>::RodXRod].add(i, j);
+		for (unsigned int r = 0; r < nr; r++) for (unsigned int s = 0; s < ns; s++)
+			if (eligible(Mobile<RealNum>::RodXString, r, s)) candidatePairs[Mobile<RealNum>::RodXString].add(r, s);
+		for (unsigned int r = 0; r < nr; r++) for (unsigned int w = 0; w < nw; w++)
+			if (eligible(Mobile<RealNum>::RodXWeight, r, w)) candidatePairs[Mobile<RealNum>::RodXWeight].add(r, w);
+		for (unsigned int w = 0; w < nw; w++) for (unsigned int s = 0; s < ns; s++)
+			if (eligible(Mobile<RealNum>::WeightXString, w, s)) candidatePairs[Mobile<RealNum>::WeightXString].add(w, s);
+		for (unsigned int i = 0; i < nw; i++) for (unsigned int j = i+1; j < nw; j++)
+			if (eligible(Mobile<RealNum>::WeightXWeight, i, j)) candidatePairs[Mobile<RealNum>::WeightXWeight].add(i, j);
+
+		boxes.resize(ns + nr + nw);
+	}
+
+	template<typename RealNum>
+	bool CompiledMobile<RealNum>::eligible(CollisionType type, unsigned int i, unsigned int j) const
+	{
+		switch (type)
+		{
+		case Mobile<RealNum>::RodXRod:
+			// Compare against only non-descendants and non-ancestors
+			return !rodSpan[i].isAncestorOf(rodSpan[j]) && !rodSpan[j].isAncestorOf(rodSpan[i]);
+		case Mobile<RealNum>::RodXString:
+			// Compare against only non-descendants and non-ancestors
+			return !stringSpan[j].isAncestorOf(rodSpan[i]) && !rodSpan[i].isAncestorOf(stringSpan[j]);
+		case Mobile<RealNum>::RodXWeight:
+			// Compare against only non-descendants
+			return !rodSpan[i].isAncestorOf(weightSpan[j]);
+		case Mobile<RealNum>::WeightXString:
+			// Compare against only non-ancestors
+			return !stringSpan[j].isAncestorOf(weightSpan[i]);
+		case Mobile<RealNum>::WeightXWeight:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	template<typename RealNum>
+	void CompiledMobile<RealNum>::update(const ParameterVector<RealNum>& params)
+	{
+		unsigned int ns = numStrings(), nr = numRods(), nw = numWeights();
+
+		for (unsigned int s = 0; s < ns; s++)
+			stringLength[s] = params[stringParam[s] + StringLength];
+		for (unsigned int r = 0; r < nr; r++)
+		{
+			rodLength[r] = params[rodParam[r] + RodLength];
+			rodConnect[r] = params[rodParam[r] + RodConnectPoint] * rodLength[r];
+		}
+		for (unsigned int w = 0; w < nw; w++)
+			weightRadius[w] = params[weightParam[w] + WeightRadius];
+
+		// Anchors: a string hangs from an end of its parent rod, which hangs from the bottom of its own parent string.
+		// Parents precede children, so one forward pass over the strings suffices.
+		for (unsigned int s = 0; s < ns; s++)
+		{
+			int r = stringParentRod[s];
+			if (r == None)
+			{
+				stringX[s] = RealNum(rootX);
+				stringY[s] = RealNum(rootY);
+			}
+			else
+			{
+				unsigned int g = rodParentString[r];
+				RealNum start = stringX[g] - rodConnect[r];
+				stringX[s] = stringSide[s] == 0 ? start : start + rodLength[r];
+				stringY[s] = stringY[g] - stringLength[g];
+			}
+		}
+		for (unsigned int r = 0; r < nr; r++)
+		{
+			unsigned int g = rodParentString[r];
+			rodStartX[r] = stringX[g] - rodConnect[r];
+			rodY[r] = stringY[g] - stringLength[g];
+		}
+		for (unsigned int w = 0; w < nw; w++)
+		{
+			unsigned int g = weightParentString[w];
+			weightX[w] = stringX[g];
+			weightY[w] = stringY[g] - stringLength[g];
+		}
+
+		// Masses: children follow parents, so one backward pass over the strings suffices.
+		for (int s = ns-1; s >= 0; s--)
+		{
+			RealNum childMass;
+			if (stringChildWeight[s] != None)
+				childMass = MobileGeometry::weightMass(weightRadius[stringChildWeight[s]]);
+			else
+			{
+				int r = stringChildRod[s];
+				childMass = MobileGeometry::rodMass(rodLength[r]) + stringMass[rodLeftString[r]] + stringMass[rodRightString[r]];
+			}
+			stringMass[s] = MobileGeometry::stringMass(stringLength[s]) + childMass;
+		}
+	}
+
+	template<typename RealNum>
+	typename CompiledMobile<RealNum>::CollisionSummary CompiledMobile<RealNum>::checkStaticCollisions(bool broadPhase) const
+	{
+		CollisionSummary summary;
+		if (broadPhase)
+		{
+			sweepAndPrune();
+			narrowPhase(overlappingPairs, summary);
+		}
+		else narrowPhase(candidatePairs, summary);
+		return summary;
+	}
+
+	template<typename RealNum>
+	void CompiledMobile<RealNum>::sweepAndPrune() const
+	{
+		// Pad the boxes a little, so that no pair pruned here could have registered a collision through
+		// roundoff in the narrow phase (e.g. a tangent chord)
+		static const double margin = 1e-6;
+
+		unsigned int b = 0;
+		for (unsigned int s = 0; s < numStrings(); s++, b++)
+		{
+			double x = valueOf(stringX[s]), y = valueOf(stringY[s]);
+			Box box = { x - margin, x + margin, y - valueOf(stringLength[s]) - margin, y + margin, StringKind, s };
+			boxes[b] = box;
+		}
+		for (unsigned int r = 0; r < numRods(); r++, b++)
+		{
+			double x = valueOf(rodStartX[r]), y = valueOf(rodY[r]);
+			Box box = { x - margin, x + valueOf(rodLength[r]) + margin, y - ROD_RADIUS - margin, y + ROD_RADIUS + margin, RodKind, r };
+			boxes[b] = box;
+		}
+		for (unsigned int w = 0; w < numWeights(); w++, b++)
+		{
+			double x = valueOf(weightX[w]), y = valueOf(weightY[w]), radius = valueOf(weightRadius[w]);
+			Box box = { x - radius - margin, x + radius + margin, y - 2*radius - margin, y + margin, WeightKind, w };
+			boxes[b] = box;
+		}
+
+		// Sweep along x, testing y for every pair whose x extents overlap
+		std::sort(boxes.begin(), boxes.end(), [](const Box& b1, const Box& b2) { return b1.xmin < b2.xmin; });
+		for (unsigned int t = 0; t < NumCollisionTypes; t++)
+			overlaps[t].clear();
+		for (unsigned int i = 0; i < boxes.size(); i++)
+		{
+			const Box& b1 = boxes[i];
+			for (unsigned int j = i+1; j < boxes.size() && boxes[j].xmin <= b1.xmax; j++)
+			{
+				const Box& b2 = boxes[j];
+				if (b2.ymin > b1.ymax || b1.ymin > b2.ymax)
+					continue;
+
+				// Put the pair in the same form as the candidate lists
+				CollisionType type;
+				const Box* first = &b1;
+				const Box* second = &b2;
+				if (b1.kind == b2.kind)
+				{
+					if (b1.kind == StringKind) continue;
+					type = (b1.kind == RodKind ? Mobile<RealNum>::RodXRod : Mobile<RealNum>::WeightXWeight);
+					if (b1.index > b2.index) std::swap(first, second);
+				}
+				else
+				{
+					if (b1.kind > b2.kind) std::swap(first, second);
+					// Now ordered by kind: (string, rod), (string, weight) or (rod, weight)
+					if (first->kind == RodKind)
+						type = Mobile<RealNum>::RodXWeight;
+					else
+					{
+						type = (second->kind == RodKind ? Mobile<RealNum>::RodXString : Mobile<RealNum>::WeightXString);
+						std::swap(first, second);
+					}
+				}
+				if (eligible(type, first->index, second->index))
+					overlaps[type].push_back(std::make_pair(first->index, second->index));
+			}
+		}
+
+		// Restore the candidate order, so that totals accumulate identically
+		for (unsigned int t = 0; t < NumCollisionTypes; t++)
+		{
+			std::sort(overlaps[t].begin(), overlaps[t].end());
+			overlappingPairs[t].clear();
+			for (const auto& p : overlaps[t])
+				overlappingPairs[t].add(p.first, p.second);
+		}
+	}
+
+	template<typename RealNum>
+	void CompiledMobile<RealNum>::narrowPhase(const IndexPairs* pairs, CollisionSummary& summary) const
+	{
+		const IndexPairs& rodRodPairs = pairs[Mobile<RealNum>::RodXRod];
+		const IndexPairs& rodStringPairs = pairs[Mobile<RealNum>::RodXString];
+		const IndexPairs& rodWeightPairs = pairs[Mobile<RealNum>::RodXWeight];
+		const IndexPairs& weightStringPairs = pairs[Mobile<RealNum>::WeightXString];
+		const IndexPairs& weightWeightPairs = pairs[Mobile<RealNum>::WeightXWeight];
+
+		for (unsigned int p = 0; p < rodRodPairs.size(); p++)
+		{
+			unsigned int i = rodRodPairs.first[p], j = rodRodPairs.second[p];
+			RealNum c = MobileGeometry::rodRodCollision(rodStartX[i], rodY[i], rodLength[i], rodStartX[j], rodY[j], rodLength[j]);
+			summary.rodXrod += c;
+			summary.rodXrodN += (valueOf(c) > 0.0);
+		}
+
+		for (unsigned int p = 0; p < rodStringPairs.size(); p++)
+		{
+			unsigned int r = rodStringPairs.first[p], s = rodStringPairs.second[p];
+			RealNum c = MobileGeometry::rodStringCollision(rodStartX[r], rodY[r], rodLength[r], stringX[s], stringY[s], stringLength[s]);
+			summary.rodXstring += c;
+			summary.rodXstringN += (valueOf(c) > 0.0);
+		}
+
+		for (unsigned int p = 0; p < rodWeightPairs.size(); p++)
+		{
+			unsigned int r = rodWeightPairs.first[p], w = rodWeightPairs.second[p];
+			RealNum c = MobileGeometry::rodWeightCollision(rodStartX[r], rodY[r], rodLength[r], weightX[w], weightY[w], weightRadius[w]);
+			summary.rodXweight += c;
+			summary.rodXweightN += (valueOf(c) > 0.0);
+		}
+
+		for (unsigned int p = 0; p < weightStringPairs.size(); p++)
+		{
+			unsigned int w = weightStringPairs.first[p], s = weightStringPairs.second[p];
+			RealNum c = MobileGeometry::weightStringCollision(weightX[w], weightY[w], weightRadius[w], stringX[s], stringY[s], stringLength[s]);
+			summary.weightXstring += c;
+			summary.weightXstringN += (valueOf(c) > 0.0);
+		}
+
+		for (unsigned int p = 0; p < weightWeightPairs.size(); p++)
+		{
+			unsigned int i = weightWeightPairs.first[p], j = weightWeightPairs.second[p];
+			RealNum c = MobileGeometry::weightWeightCollision(weightX[i], weightY[i], weightRadius[i], weightX[j], weightY[j], weightRadius[j]);
+			summary.weightXweight += c;
+			summary.weightXweightN += (valueOf(c) > 0.0);
+		}
+	}
+
+	template<typename RealNum>
+	RealNum CompiledMobile<RealNum>::softMaxTorqueNorm() const
+	{
+		unsigned int nr = numRods();
+		std::vector<RealNum> torqueNorms(nr, 0.0);
+		for (unsigned int r = 0; r < nr; r++)
+		{
+			torqueNorms[r] = MobileGeometry::rodTorqueNorm(rodConnect[r], rodLength[r],
+				stringMass[rodLeftString[r]], stringMass[rodRightString[r]]);
+		}
+		return Math::softMax(torqueNorms, 5.0);
+	}
+
+	template<typename RealNum>
+	void CompiledMobile<RealNum>::clearAdjoints(Adjoints& adj) const
+	{
+		unsigned int ns = numStrings(), nr = numRods(), nw = numWeights();
+		adj.stringLength.assign(ns, 0.0); adj.stringX.assign(ns, 0.0); adj.stringY.assign(ns, 0.0); adj.stringMass.assign(ns, 0.0);
+		adj.rodLength.assign(nr, 0.0); adj.rodConnect.assign(nr, 0.0); adj.rodStartX.assign(nr, 0.0); adj.rodY.assign(nr, 0.0);
+		adj.weightRadius.assign(nw, 0.0); adj.weightX.assign(nw, 0.0); adj.weightY.assign(nw, 0.0);
+	}
+
+	template<typename RealNum>
+	void CompiledMobile<RealNum>::collisionAdjoints(const double* weights, bool broadPhase, Adjoints& adj) const
+	{
+		const IndexPairs* pairs = candidatePairs;
+		if (broadPhase)
+		{
+			sweepAndPrune();
+			pairs = overlappingPairs;
+		}
+
+		// Each pair's measure and partials (w.r.t. its six arguments), pushed onto the adjoints of those arguments
+		double x[6], value, partials[6];
+		double* a[6];
+		auto arg = [&](unsigned int k, const std::vector<RealNum>& state, std::vector<double>& adjoints, unsigned int i)
+		{
+			x[k] = valueOf(state[i]);
+			a[k] = &adjoints[i];
+		};
+		auto accumulate = [&](double weight)
+		{
+			for (unsigned int k = 0; k < 6; k++)
+				*a[k] += weight * partials[k];
+		};
+
+		const IndexPairs& rodRodPairs = pairs[Mobile<RealNum>::RodXRod];
+		for (unsigned int p = 0; p < rodRodPairs.size(); p++)
+		{
+			unsigned int i = rodRodPairs.first[p], j = rodRodPairs.second[p];
+			arg(0, rodStartX, adj.rodStartX, i);
+			arg(1, rodY, adj.rodY, i);
+			arg(2, rodLength, adj.rodLength, i);
+			arg(3, rodStartX, adj.rodStartX, j);
+			arg(4, rodY, adj.rodY, j);
+			arg(5, rodLength, adj.rodLength, j);
+			if (MobileGeometry::rodRodCollision(x, value, partials))
+				accumulate(weights[Mobile<RealNum>::RodXRod]);
+		}
+
+		const IndexPairs& rodStringPairs = pairs[Mobile<RealNum>::RodXString];
+		for (unsigned int p = 0; p < rodStringPairs.size(); p++)
+		{
+			unsigned int r = rodStringPairs.first[p], s = rodStringPairs.second[p];
+			arg(0, rodStartX, adj.rodStartX, r);
+			arg(1, rodY, adj.rodY, r);
+			arg(2, rodLength, adj.rodLength, r);
+			arg(3, stringX, adj.stringX, s);
+			arg(4, stringY, adj.stringY, s);
+			arg(5, stringLength, adj.stringLength, s);
+			if (MobileGeometry::rodStringCollision(x, value, partials))
+				accumulate(weights[Mobile<RealNum>::RodXString]);
+		}
+
+		const IndexPairs& rodWeightPairs = pairs[Mobile<RealNum>::RodXWeight];
+		for (unsigned int p = 0; p < rodWeightPairs.size(); p++)
+		{
+			unsigned int r = rodWeightPairs.first[p], w = rodWeightPairs.second[p];
+			arg(0, rodStartX, adj.rodStartX, r);
+			arg(1, rodY, adj.rodY, r);
+			arg(2, rodLength, adj.rodLength, r);
+			arg(3, weightX, adj.weightX, w);
+			arg(4, weightY, adj.weightY, w);
+			arg(5, weightRadius, adj.weightRadius, w);
+			if (MobileGeometry::rodWeightCollision(x, value, partials))
+				accumulate(weights[Mobile<RealNum>::RodXWeight]);
+		}
+
+		const IndexPairs& weightStringPairs = pairs[Mobile<RealNum>::WeightXString];
+		for (unsigned int p = 0; p < weightStringPairs.size(); p++)
+		{
+			unsigned int w = weightStringPairs.first[p], s = weightStringPairs.second[p];
+			arg(0, weightX, adj.weightX, w);
+			arg(1, weightY, adj.weightY, w);
+			arg(2, weightRadius, adj.weightRadius, w);
+			arg(3, stringX, adj.stringX, s);
+			arg(4, stringY, adj.stringY, s);
+			arg(5, stringLength, adj.stringLength, s);
+			if (MobileGeometry::weightStringCollision(x, value, partials))
+				accumulate(weights[Mobile<RealNum>::WeightXString]);
+		}
+
+		const IndexPairs& weightWeightPairs = pairs[Mobile<RealNum>::WeightXWeight];
+		for (unsigned int p = 0; p < weightWeightPairs.size(); p++)
+		{
+			unsigned int i = weightWeightPairs.first[p], j = weightWeightPairs.second[p];
+			arg(0, weightX, adj.weightX, i);
+			arg(1, weightY, adj.weightY, i);
+			arg(2, weightRadius, adj.weightRadius, i);
+			arg(3, weightX, adj.weightX, j);
+			arg(4, weightY, adj.weightY, j);
+			arg(5, weightRadius, adj.weightRadius, j);
+			if (MobileGeometry::weightWeightCollision(x, value, partials))
+				accumulate(weights[Mobile<RealNum>::WeightXWeight]);
+		}
+	}
+
+	template<typename RealNum>
+	void CompiledMobile<RealNum>::torqueAdjoints(double weight, Adjoints& adj) const
+	{
+		unsigned int nr = numRods();
+		std::vector<double> torqueNorms(nr), torquePartials(4*nr), smaxPartials(nr);
+		for (unsigned int r = 0; r < nr; r++)
+		{
+			double x[4] = { valueOf(rodConnect[r]), valueOf(rodLength[r]),
+				valueOf(stringMass[rodLeftString[r]]), valueOf(stringMass[rodRightString[r]]) };
+			MobileGeometry::rodTorqueNorm(x, torqueNorms[r], &torquePartials[4*r]);
+		}
+		if (nr == 0)
+			return;
+		Math::softMax(torqueNorms.data(), nr, 5.0, smaxPartials.data());
+		for (unsigned int r = 0; r < nr; r++)
+		{
+			double w = weight * smaxPartials[r];
+			adj.rodConnect[r] += w * torquePartials[4*r];
+			adj.rodLength[r] += w * torquePartials[4*r + 1];
+			adj.stringMass[rodLeftString[r]] += w * torquePartials[4*r + 2];
+			adj.stringMass[rodRightString[r]] += w * torquePartials[4*r + 3];
+		}
+	}
+
+	template<typename RealNum>
+	void CompiledMobile<RealNum>::backpropagate(const ParameterVector<double>& params, const Adjoints& adj, double* gradient) const
+	{
+		unsigned int ns = numStrings(), nr = numRods(), nw = numWeights();
+		Adjoints a = adj;
+
+		// Masses, in the reverse of update's order: parents pass their adjoints down to their children
+		double dStringMass = MobileGeometry::stringMass(1.0), dRodMass = MobileGeometry::rodMass(1.0);
+		for (unsigned int s = 0; s < ns; s++)
+		{
+			a.stringLength[s] += a.stringMass[s] * dStringMass;
+			if (stringChildWeight[s] != None)
+			{
+				int w = stringChildWeight[s];
+				double radius = valueOf(weightRadius[w]);
+				a.weightRadius[w] += a.stringMass[s] * 3.0*MobileGeometry::weightMass(1.0)*radius*radius;
+			}
+			else
+			{
+				int r = stringChildRod[s];
+				a.rodLength[r] += a.stringMass[s] * dRodMass;
+				a.stringMass[rodLeftString[r]] += a.stringMass[s];
+				a.stringMass[rodRightString[r]] += a.stringMass[s];
+			}
+		}
+
+		// Anchors: children pass their adjoints up to their parents
+		for (unsigned int w = 0; w < nw; w++)
+		{
+			unsigned int g = weightParentString[w];
+			a.stringX[g] += a.weightX[w];
+			a.stringY[g] += a.weightY[w];
+			a.stringLength[g] -= a.weightY[w];
+		}
+		for (unsigned int r = 0; r < nr; r++)
+		{
+			unsigned int g = rodParentString[r];
+			a.stringX[g] += a.rodStartX[r];
+			a.rodConnect[r] -= a.rodStartX[r];
+			a.stringY[g] += a.rodY[r];
+			a.stringLength[g] -= a.rodY[r];
+		}
+		for (int s = ns-1; s >= 0; s--)
+		{
+			int r = stringParentRod[s];
+			if (r == None)
+				continue;
+			unsigned int g = rodParentString[r];
+			a.stringX[g] += a.stringX[s];
+			a.rodConnect[r] -= a.stringX[s];
+			if (stringSide[s] != 0)
+				a.rodLength[r] += a.stringX[s];
+			a.stringY[g] += a.stringY[s];
+			a.stringLength[g] -= a.stringY[s];
+		}
+
+		// Parameters
+		for (unsigned int s = 0; s < ns; s++)
+			gradient[stringParam[s] + StringLength] += a.stringLength[s];
+		for (unsigned int r = 0; r < nr; r++)
+		{
+			// rodConnect = connect point * length
+			gradient[rodParam[r] + RodConnectPoint] += a.rodConnect[r] * valueOf(rodLength[r]);
+			gradient[rodParam[r] + RodLength] += a.rodLength[r] + a.rodConnect[r] * params[rodParam[r] + RodConnectPoint];
+		}
+		for (unsigned int w = 0; w < nw; w++)
+			gradient[weightParam[w] + WeightRadius] += a.weightRadius[w];
+	}
+}
+
+#endif
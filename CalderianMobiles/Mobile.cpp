@@ -4,53 +4,285 @@ using namespace std;
 using namespace Eigen;
 using namespace simference;
 using namespace stan::agrad;
+using simference::AD::Recorded;
 
 namespace simference
 {
-	template<>
-	void Mobile<var>::StringComponent::render() const
+	namespace MobileGeometry
 	{
-		SET_STRING_COLOR;
-		glMatrixMode(GL_MODELVIEW);
-		glPushMatrix();
-		glTranslatef(anchor.x().val(), anchor.y().val(), anchor.z().val());
-		glRotatef(90.0f, 1.0f, 0.0f, 0.0f);
-		gluCylinder(quadric, STRING_RADIUS, STRING_RADIUS, sym->params[StringLength].val(), RADIAL_SLICES, 1);
-		glPopMatrix();
-
-		child->render();
-	}
+		// Math::intervalOverlapAmount, with the partials w.r.t. (s1, e1, s2, e2).
+		// Returns false if the intervals don't overlap.
+		static bool intervalOverlapAmount(double s1, double e1, double s2, double e2, double& amount, double* d)
+		{
+			if (!Math::intervalsOverlap(s1, e1, s2, e2))
+				return false;
+			d[0] = d[1] = d[2] = d[3] = 0.0;
+			if (s1 < s2 && e1 < e2)
+			{
+				amount = e1 - s2; d[1] = 1.0; d[2] = -1.0;
+			}
+			else if (s2 < s1 && e2 < e1)
+			{
+				amount = e2 - s1; d[3] = 1.0; d[0] = -1.0;
+			}
+			else if (s1 < e2 && e2 < e1)
+			{
+				amount = e2 - s2; d[3] = 1.0; d[2] = -1.0;
+			}
+			else
+			{
+				amount = e1 - s1; d[1] = 1.0; d[0] = -1.0;
+			}
+			return true;
+		}
 
-	template<>
-	void Mobile<var>::WeightComponent::render() const
-	{
-		glMatrixMode(GL_MODELVIEW);
-		glPushMatrix();
+		// partials = sum_k d[k] * endpointPartials[k], for the four interval endpoints
+		static void chainEndpoints(const double* d, const double endpointPartials[4][6], double* partials)
+		{
+			for (unsigned int i = 0; i < 6; i++)
+			{
+				partials[i] = 0.0;
+				for (unsigned int k = 0; k < 4; k++)
+					partials[i] += d[k] * endpointPartials[k][i];
+			}
+		}
 
-		var radius = sym->params[WeightRadius];
+		typedef bool (*Measure)(const double* x, double& value, double* partials);
 
-		// Push down by the radius
-		glTranslatef(anchor.x().val(), (anchor.y()-radius).val(), anchor.z().val());
+		bool rodTorqueNorm(const double* x, double& value, double* partials)
+		{
+			double scp = x[0], l = x[1];
+			double fl = x[2] * GRAVITY_Y, fr = x[3] * GRAVITY_Y;
+			double torque = -scp * fl + (l - scp) * fr;
+			double sign = (torque > 0.0 ? 1.0 : (torque < 0.0 ? -1.0 : 0.0));
+			value = fabs(torque);
+			partials[0] = -sign*(fl + fr);
+			partials[1] = sign*fr;
+			partials[2] = -sign*scp*GRAVITY_Y;
+			partials[3] = sign*(l - scp)*GRAVITY_Y;
+			return true;
+		}
 
-		// Draw a weight as a sphere
-		SET_WEIGHT_COLOR;
-		glutSolidSphere(radius.val(), RADIAL_SLICES, RADIAL_SLICES);
-		glPopMatrix();
-	}
+		bool rodRodCollision(const double* x, double& value, double* partials)
+		{
+			// xs1, y1, length1, xs2, y2, length2
+			if (!Math::intervalsOverlap(x[1] - ROD_RADIUS, x[1] + ROD_RADIUS, x[4] - ROD_RADIUS, x[4] + ROD_RADIUS))
+				return false;
+			double d[4];
+			if (!intervalOverlapAmount(x[0], x[0] + x[2], x[3], x[3] + x[5], value, d))
+				return false;
+			partials[0] = d[0] + d[1]; partials[1] = 0.0; partials[2] = d[1];
+			partials[3] = d[2] + d[3]; partials[4] = 0.0; partials[5] = d[3];
+			return true;
+		}
 
-	template<>
-	void Mobile<var>::RodComponent::render() const
-	{
-		// Draw a rod
-		SET_ROD_COLOR;
-		glMatrixMode(GL_MODELVIEW);
-		glPushMatrix();
-		glTranslatef((anchor.x()-scaledConnectPoint()).val(), anchor.y().val(), anchor.z().val());
-		glRotatef(90.0f, 0.0f, 1.0f, 0.0f);
-		gluCylinder(quadric, ROD_RADIUS, ROD_RADIUS, sym->params[RodLength].val(), RADIAL_SLICES, 1);
-		glPopMatrix();
-
-		leftChild->render();
-		rightChild->render();
+		bool rodStringCollision(const double* x, double& value, double* partials)
+		{
+			double xsv = x[0], yv = x[1], sxv = x[3], syv = x[4];
+			double re = xsv + x[2];
+			double se = syv - x[5];
+			if (!((sxv > xsv && sxv < re) && (se < yv && syv > yv)))
+				return false;
+
+			// The measure is the least of four distances; pick it the way the nested min()s do
+			double t[4] = { sxv - xsv, re - sxv, syv - yv, yv - se };
+			static const double dt[4][6] =
+			{
+				// xs, y, length, sx, sy, slength
+				{ -1.0, 0.0, 0.0, 1.0, 0.0, 0.0 },
+				{ 1.0, 0.0, 1.0, -1.0, 0.0, 0.0 },
+				{ 0.0, -1.0, 0.0, 0.0, 1.0, 0.0 },
+				{ 0.0, 1.0, 0.0, 0.0, -1.0, 1.0 }
+			};
+			unsigned int k = (t[3] < t[2] ? 3 : 2);
+			k = (t[k] < t[1] ? k : 1);
+			k = (t[k] < t[0] ? k : 0);
+			value = t[k];
+			std::copy(dt[k], dt[k] + 6, partials);
+			return true;
+		}
+
+		bool rodWeightCollision(const double* x, double& value, double* partials)
+		{
+			// Same computation as the generic version
+			double xsv = x[0], yv = x[1], wxv = x[3], r = x[5];
+			double cy = x[4] - r;
+			double b = 2*(xsv - wxv);
+			double c = (xsv*xsv + yv*yv) - 2*(xsv*wxv + yv*cy) + (wxv*wxv + cy*cy) - r*r;
+			double r1, r2;
+			if (Math::solveQuadratic(1.0, b, c, r1, r2) <= 0)
+				return false;
+			double d[4];
+			if (!intervalOverlapAmount(xsv, xsv + x[2], xsv + r1, xsv + r2, value, d))
+				return false;
+
+			// The chord spans wx -/+ sdet/2, where sdet^2 = 4(r^2 - v^2), v = y - (wy - r)
+			double sdet = sqrt(b*b - 4*c);
+			double v = yv - cy;
+			double hy = -2*v/sdet, hwy = 2*v/sdet, hr = 2*(r - v)/sdet;		// partials of sdet/2
+			double endpointPartials[4][6] =
+			{
+				// xs, y, length, wx, wy, radius
+				{ 1.0, 0.0, 0.0, 0.0, 0.0, 0.0 },
+				{ 1.0, 0.0, 1.0, 0.0, 0.0, 0.0 },
+				{ 0.0, -hy, 0.0, 1.0, -hwy, -hr },
+				{ 0.0, hy, 0.0, 1.0, hwy, hr }
+			};
+			chainEndpoints(d, endpointPartials, partials);
+			return true;
+		}
+
+		bool weightStringCollision(const double* x, double& value, double* partials)
+		{
+			// Same computation as the generic version
+			double wxv = x[0], r = x[2], sxv = x[3], sl = x[5];
+			double py = x[4] - sl;
+			double cy = x[1] - r;
+			double b = 2*(py - cy);
+			double c = (sxv*sxv + py*py) - 2*(sxv*wxv + py*cy) + (wxv*wxv + cy*cy) - r*r;
+			double r1, r2;
+			if (Math::solveQuadratic(1.0, b, c, r1, r2) <= 0)
+				return false;
+			double d[4];
+			if (!intervalOverlapAmount(py, py + sl, py + r1, py + r2, value, d))
+				return false;
+
+			// The chord spans (wy - r) -/+ sdet/2, where sdet^2 = 4(r^2 - u^2), u = sx - wx
+			double sdet = sqrt(b*b - 4*c);
+			double u = sxv - wxv;
+			double hsx = -2*u/sdet, hwx = 2*u/sdet, hr = 2*r/sdet;		// partials of sdet/2
+			double endpointPartials[4][6] =
+			{
+				// wx, wy, radius, sx, sy, slength
+				{ 0.0, 0.0, 0.0, 0.0, 1.0, -1.0 },
+				{ 0.0, 0.0, 0.0, 0.0, 1.0, 0.0 },
+				{ -hwx, 1.0, -1.0 - hr, -hsx, 0.0, 0.0 },
+				{ hwx, 1.0, -1.0 + hr, hsx, 0.0, 0.0 }
+			};
+			chainEndpoints(d, endpointPartials, partials);
+			return true;
+		}
+
+		bool weightWeightCollision(const double* x, double& value, double* partials)
+		{
+			double dx = x[0] - x[3];
+			double dy = (x[1] - x[2]) - (x[4] - x[5]);
+			double d = sqrt(dx*dx + dy*dy);
+			double penetration = (x[2] + x[5]) - d;
+			if (penetration < 0.0)
+				return false;
+			value = penetration;
+			partials[0] = -dx/d; partials[1] = -dy/d; partials[2] = 1.0 + dy/d;
+			partials[3] = dx/d; partials[4] = dy/d; partials[5] = 1.0 - dy/d;
+			return true;
+		}
+
+		// A measure on vars, as a single node (or a constant, where it's identically zero)
+		template<unsigned int N>
+		static var fusedMeasure(Measure measure, const var* operands)
+		{
+			double x[N], value, partials[N];
+			for (unsigned int i = 0; i < N; i++)
+				x[i] = operands[i].val();
+			if (!measure(x, value, partials))
+				return 0.0;
+			return AD::fused(value, N, operands, partials);
+		}
+
+		// A measure as a tape kernel (which is zero, with zero partials, where the measure is identically zero)
+		class MeasureKernel : public AD::Kernel
+		{
+		public:
+			MeasureKernel(Measure m) : measure(m) {}
+			double evaluate(unsigned int n, const double* inputs, double* partials) const
+			{
+				double value;
+				if (measure(inputs, value, partials))
+					return value;
+				std::fill(partials, partials + n, 0.0);
+				return 0.0;
+			}
+		private:
+			Measure measure;
+		};
+
+		static const MeasureKernel rodTorqueNormKernel(rodTorqueNorm);
+		static const MeasureKernel rodRodCollisionKernel(rodRodCollision);
+		static const MeasureKernel rodStringCollisionKernel(rodStringCollision);
+		static const MeasureKernel rodWeightCollisionKernel(rodWeightCollision);
+		static const MeasureKernel weightStringCollisionKernel(weightStringCollision);
+		static const MeasureKernel weightWeightCollisionKernel(weightWeightCollision);
+
+		var rodTorqueNorm(const var& scaledConnectPoint, const var& length, const var& leftMass, const var& rightMass)
+		{
+			var operands[4] = { scaledConnectPoint, length, leftMass, rightMass };
+			return fusedMeasure<4>(rodTorqueNorm, operands);
+		}
+
+		var rodRodCollision(const var& xs1, const var& y1, const var& length1, const var& xs2, const var& y2, const var& length2)
+		{
+			var operands[6] = { xs1, y1, length1, xs2, y2, length2 };
+			return fusedMeasure<6>(rodRodCollision, operands);
+		}
+
+		var rodStringCollision(const var& xs, const var& y, const var& length, const var& sx, const var& sy, const var& slength)
+		{
+			var operands[6] = { xs, y, length, sx, sy, slength };
+			return fusedMeasure<6>(rodStringCollision, operands);
+		}
+
+		var rodWeightCollision(const var& xs, const var& y, const var& length, const var& wx, const var& wy, const var& radius)
+		{
+			var operands[6] = { xs, y, length, wx, wy, radius };
+			return fusedMeasure<6>(rodWeightCollision, operands);
+		}
+
+		var weightStringCollision(const var& wx, const var& wy, const var& radius, const var& sx, const var& sy, const var& slength)
+		{
+			var operands[6] = { wx, wy, radius, sx, sy, slength };
+			return fusedMeasure<6>(weightStringCollision, operands);
+		}
+
+		var weightWeightCollision(const var& x1, const var& y1, const var& radius1, const var& x2, const var& y2, const var& radius2)
+		{
+			var operands[6] = { x1, y1, radius1, x2, y2, radius2 };
+			return fusedMeasure<6>(weightWeightCollision, operands);
+		}
+
+		Recorded rodTorqueNorm(const Recorded& scaledConnectPoint, const Recorded& length, const Recorded& leftMass, const Recorded& rightMass)
+		{
+			Recorded operands[4] = { scaledConnectPoint, length, leftMass, rightMass };
+			return AD::call(rodTorqueNormKernel, 4, operands);
+		}
+
+		Recorded rodRodCollision(const Recorded& xs1, const Recorded& y1, const Recorded& length1, const Recorded& xs2, const Recorded& y2, const Recorded& length2)
+		{
+			Recorded operands[6] = { xs1, y1, length1, xs2, y2, length2 };
+			return AD::call(rodRodCollisionKernel, 6, operands);
+		}
+
+		Recorded rodStringCollision(const Recorded& xs, const Recorded& y, const Recorded& length, const Recorded& sx, const Recorded& sy, const Recorded& slength)
+		{
+			Recorded operands[6] = { xs, y, length, sx, sy, slength };
+			return AD::call(rodStringCollisionKernel, 6, operands);
+		}
+
+		Recorded rodWeightCollision(const Recorded& xs, const Recorded& y, const Recorded& length, const Recorded& wx, const Recorded& wy, const Recorded& radius)
+		{
+			Recorded operands[6] = { xs, y, length, wx, wy, radius };
+			return AD::call(rodWeightCollisionKernel, 6, operands);
+		}
+
+		Recorded weightStringCollision(const Recorded& wx, const Recorded& wy, const Recorded& radius, const Recorded& sx, const Recorded& sy, const Recorded& slength)
+		{
+			Recorded operands[6] = { wx, wy, radius, sx, sy, slength };
+			return AD::call(weightStringCollisionKernel, 6, operands);
+		}
+
+		Recorded weightWeightCollision(const Recorded& x1, const Recorded& y1, const Recorded& radius1, const Recorded& x2, const Recorded& y2, const Recorded& radius2)
+		{
+			Recorded operands[6] = { x1, y1, radius1, x2, y2, radius2 };
+			return AD::call(weightWeightCollisionKernel, 6, operands);
+		}
 	}
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include "MobileGrammar.h"
 #include "../Common/DAD.h"
 #include "../Common/Math.h"
+#include "../Common/FusedAD.h"
+#include "../Common/ReplayAD.h"
 #include <stan/agrad/agrad.hpp>
 #include <Eigen/Core>
 #include <Eigen/Geometry>
@@ -19,46 +21,80 @@ using namespace simference::Grammar::MobileGrammar;
 
 namespace simference
 {
+	// Representation of a rod's torque: in 3d a vector (along z), in the plane just the moment
+	template<typename RealNum, int Dim>
+	struct MobileTorque
+	{
+		typedef Eigen::Matrix<RealNum, 3, 1> Type;
+		static Type fromMoment(const RealNum& m) { return Type(RealNum(0.0), RealNum(0.0), m); }
+	};
+
 	template<typename RealNum>
+	struct MobileTorque<RealNum, 2>
+	{
+		typedef RealNum Type;
+		static Type fromMoment(const RealNum& m) { return m; }
+	};
+
+	// A mobile hangs in the xy plane, so everything about it can be computed in 2d.
+	// Dim = 3 keeps a z coordinate around (as the renderer sees it).
+	template<typename RealNum, int Dim = 3>
 	class Mobile
 	{
 	public:
 
-		typedef Eigen::Matrix<RealNum, 3, 1> Vector3r;
+		typedef Eigen::Matrix<RealNum, Dim, 1> VectorNr;
+		typedef typename MobileTorque<RealNum, Dim>::Type Torque;
 		typedef unsigned long NodeNum;
 		typedef BCAD<NodeNum> NodeCode;
 
 		class Component
 		{
 		public:
+			// Kind bits for is/as, as for Symbol
+			enum { KindBit = 1 << 0 };
 			Component(NodeCode* parentCode, NodeNum siblingId, NodeNum numSiblings) :
-				code(parentCode, siblingId, numSiblings) {}
+				code(parentCode, siblingId, numSiblings), kinds(KindBit) {}
 
 			virtual void render() const = 0;
-			virtual RealNum mass() const = 0;
-			virtual void updateAnchors(const Vector3r& a) { anchor = a; }
+			// Mass of this component and everything hanging from it (as of the last Mobile::updateAnchors)
+			RealNum mass() const { return subtreeMass; }
+			// Recomputes the subtree mass, assuming those of the children are up to date
+			virtual void aggregateMass() = 0;
+			virtual Symbol<RealNum>* symbol() const = 0;
+			virtual void updateAnchors(const VectorNr& a) { anchor = a; }
 			virtual unsigned int numChildren() const { return 0; }
 			virtual Component* firstChild() const { return NULL; }
 			virtual Component* secondChild() const { return NULL; }
-			template<class T> bool is() { return dynamic_cast<T*>(this) != NULL; }
-			template<class T> T* as() { return dynamic_cast<T*>(this); }
+			template<class T> bool is() const { return (kinds & T::KindBit) != 0; }
+			template<class T> T* as() { return is<T>() ? static_cast<T*>(this) : NULL; }
 			bool isDescendantOf(Component* other) const { return code < other->code; }
 			bool isAncestorOf(Component* other) const { return other->code < code; }
 
-			Vector3r anchor;
+			// Anchor position as a plain 3d point (for rendering)
+			Eigen::Vector3d anchorPoint() const
+			{
+				return Eigen::Vector3d(valueOf(anchor.x()), valueOf(anchor.y()), Dim > 2 ? valueOf(anchor[Dim-1]) : 0.0);
+			}
+
+			VectorNr anchor;
 			NodeCode code;
+			unsigned int kinds;
+			RealNum subtreeMass;
 		};
 		typedef std::shared_ptr<Component> ComponentPtr;
 
 		class StringComponent : public Component
 		{
 		public:
+			enum { KindBit = 1 << 1 };
 			StringComponent(StringTerminal<RealNum>* st,
 				NodeCode* parentCode, NodeNum siblingId, NodeNum numSiblings)
-				: Component(parentCode, siblingId, numSiblings), sym(st) {}
+				: Component(parentCode, siblingId, numSiblings), sym(st) { this->kinds |= KindBit; }
 			void render() const;
-			RealNum mass() const;
-			void updateAnchors(const Vector3r& a);
+			void aggregateMass();
+			Symbol<RealNum>* symbol() const { return sym; }
+			void updateAnchors(const VectorNr& a);
 			unsigned int numChildren() const { return 1; }
 			Component* firstChild() const { return child.get(); }
 			StringTerminal<RealNum>* sym;
@@ -68,11 +104,13 @@ namespace simference
 		class WeightComponent : public Component
 		{
 		public:
+			enum { KindBit = 1 << 2 };
 			WeightComponent(WeightTerminal<RealNum>* wt,
 				NodeCode* parentCode, NodeNum siblingId, NodeNum numSiblings)
-				: Component(parentCode, siblingId, numSiblings), sym(wt) {}
+				: Component(parentCode, siblingId, numSiblings), sym(wt) { this->kinds |= KindBit; }
 			void render() const;
-			RealNum mass() const;
+			void aggregateMass();
+			Symbol<RealNum>* symbol() const { return sym; }
 			RealNum collision(StringComponent* str) const;
 			RealNum collision(WeightComponent* weight) const;
 			WeightTerminal<RealNum>* sym;
@@ -81,14 +119,17 @@ namespace simference
 		class RodComponent : public Component
 		{
 		public:
+			enum { KindBit = 1 << 3 };
 			RodComponent(RodTerminal<RealNum>* rt,
 				NodeCode* parentCode, NodeNum siblingId, NodeNum numSiblings)
-				: Component(parentCode, siblingId, numSiblings), sym(rt) {}
+				: Component(parentCode, siblingId, numSiblings), sym(rt) { this->kinds |= KindBit; }
 
 			void render() const;
-			RealNum mass() const;
-			void updateAnchors(const Vector3r& a);
-			Vector3r torque() const;
+			void aggregateMass();
+			Symbol<RealNum>* symbol() const { return sym; }
+			void updateAnchors(const VectorNr& a);
+			Torque torque() const;
+			RealNum torqueNorm() const;
 			unsigned int numChildren() const { return 2; }
 			Component* firstChild() const { return leftChild.get(); }
 			Component* secondChild() const { return rightChild.get(); }
@@ -104,6 +145,29 @@ namespace simference
 			RodTerminal<RealNum>* sym;
 		};
 
+		enum CollisionType
+		{
+			RodXRod = 0,
+			RodXString,
+			RodXWeight,
+			WeightXString,
+			WeightXWeight,
+			NumCollisionTypes
+		};
+
+		// A pair of components that are eligible to collide with one another
+		// (i.e. neither one hangs from the other)
+		class CollisionPair
+		{
+		public:
+			CollisionPair(Component* c1, Component* c2, CollisionType t)
+				: first(c1), second(c2), type(t) {}
+			RealNum collision() const;
+			Component* first;
+			Component* second;
+			CollisionType type;
+		};
+
 		class CollisionSummary
 		{
 		public:
@@ -117,17 +181,25 @@ namespace simference
 				weightXstringN, weightXweightN;
 		};
 
-		Mobile(typename String<RealNum>::type derivation, const Eigen::Vector3d& anchor);
+		Mobile(const typename String<RealNum>::type& derivation, const Eigen::Vector3d& anchor);
 
 		void render() const;
+		// Recomputes everything that depends on the parameters: anchors (top-down)
+		// and subtree masses (bottom-up)
 		void updateAnchors(const Eigen::Vector3d& a)
 		{
 			rootAnchor = a;
-			Vector3r ar(a.x(), a.y(), a.z());
+			VectorNr ar;
+			for (int i = 0; i < Dim; i++) ar[i] = a[i];
 			root->updateAnchors(ar);
+			updateMasses();
 		}
 		void updateAnchors() { updateAnchors(rootAnchor); }
 		CollisionSummary checkStaticCollisions() const;
+		// Pairs of components eligible to collide (fixed for a given structure)
+		const std::vector<CollisionPair>& collisionPairs() const { return candidatePairs; }
+		const std::vector<RodComponent*>& rods() const { return rodNodes; }
+		const std::vector<Component*>& components() const { return nodes; }
 		bool sanityCheckNodeCodes() const;
 		void printNodeCodes() const;
 		RealNum netTorqueNorm() const;
@@ -136,22 +208,30 @@ namespace simference
 	private:
 		ComponentPtr root;
 		Eigen::Vector3d rootAnchor;
+		std::vector<Component*> nodes;		// breadth-first, so parents precede children
+		std::vector<RodComponent*> rodNodes;
+		std::vector<CollisionPair> candidatePairs;		// grouped by type
 		static GLUquadric* quadric;
 
 		template<class T> std::vector<T*> nodesOfType() const;
+		void buildCollisionPairs();
+		void updateMasses();
 	};
 
 
 	//////////////////// Implementation ///////////////////////////////
 
 
-	template<typename RealNum>
-	Mobile<RealNum>::Mobile(typename String<RealNum>::type derivation, const Eigen::Vector3d& anchor)
+	template<typename RealNum, int Dim>
+	Mobile<RealNum, Dim>::Mobile(const typename String<RealNum>::type& derivation, const Eigen::Vector3d& anchor)
 	{
-		function<ComponentPtr(NodeCode*)> helper = [&helper, &derivation](NodeCode* code) -> ComponentPtr
+		// The components appear in the derivation in pre-order
+		unsigned int next = 0;
+		function<ComponentPtr(NodeCode*)> helper = [&helper, &derivation, &next](NodeCode* code) -> ComponentPtr
 		{
-			auto head = derivation.back();
-			derivation.pop_back();
+			if (next == derivation.size())
+				throw "Mobile::Mobile - Malformed input string!";
+			Symbol<RealNum>* head = derivation[next++].get();
 			if (head->is<StringTerminal<RealNum>>())
 			{
 				auto st = head->as<StringTerminal<RealNum>>();
@@ -173,16 +253,26 @@ namespace simference
 			else throw "Mobile::Mobile - Malformed input string!";
 		};
 
-		std::reverse(derivation.begin(), derivation.end());
 		root = helper(NULL);
+		nodes = nodesOfType<Component>();
+		rodNodes = nodesOfType<RodComponent>();
+		buildCollisionPairs();
 		updateAnchors(anchor);
 	}
 
-	template<typename RealNum>
-	GLUquadric* Mobile<RealNum>::quadric = gluNewQuadric();
+	template<typename RealNum, int Dim>
+	void Mobile<RealNum, Dim>::updateMasses()
+	{
+		// Children follow their parents, so a single backward pass aggregates every subtree
+		for (auto it = nodes.rbegin(); it != nodes.rend(); it++)
+			(*it)->aggregateMass();
+	}
 
-	template<typename RealNum>
-	void Mobile<RealNum>::render() const
+	template<typename RealNum, int Dim>
+	GLUquadric* Mobile<RealNum, Dim>::quadric = gluNewQuadric();
+
+	template<typename RealNum, int Dim>
+	void Mobile<RealNum, Dim>::render() const
 	{
 		glMatrixMode(GL_MODELVIEW);
 		glPushMatrix();
@@ -195,9 +285,9 @@ namespace simference
 		glPopMatrix();
 	}
 
-	template<typename RealNum>
+	template<typename RealNum, int Dim>
 	template<class T>
-	std::vector<T*> Mobile<RealNum>::nodesOfType() const
+	std::vector<T*> Mobile<RealNum, Dim>::nodesOfType() const
 	{
 		vector<T*> nodes;
 
@@ -218,12 +308,10 @@ namespace simference
 		return nodes;
 	}
 
-	template<typename RealNum>
-	typename Mobile<RealNum>::CollisionSummary Mobile<RealNum>::checkStaticCollisions() const
+	template<typename RealNum, int Dim>
+	void Mobile<RealNum, Dim>::buildCollisionPairs()
 	{
-		CollisionSummary summary;
-
-		auto rods = nodesOfType<RodComponent>();
+		const auto& rods = rodNodes;
 		auto strings = nodesOfType<StringComponent>();
 		auto weights = nodesOfType<WeightComponent>();
 
@@ -238,11 +326,7 @@ namespace simference
 					auto rod2 = rods[j];
 					// Compare against only non-descendants and non-ancestors
 					if (!rod1->isDescendantOf(rod2) && !rod1->isAncestorOf(rod2))
-					{
-						RealNum c = rod1->collision(rod2);
-						summary.rodXrod += c;
-						summary.rodXrodN += (c > 0.0);
-					}
+						candidatePairs.push_back(CollisionPair(rod1, rod2, RodXRod));
 				}
 			}
 		}
@@ -252,11 +336,7 @@ namespace simference
 		{
 			// Compare against only non-descendants and non-ancestors
 			if (!str->isAncestorOf(rod) && !str->isDescendantOf(rod))
-			{
-				RealNum c = rod->collision(str);
-				summary.rodXstring += c;
-				summary.rodXstringN += (c > 0.0);
-			}
+				candidatePairs.push_back(CollisionPair(rod, str, RodXString));
 		}
 
 		// rod vs. weight
@@ -264,11 +344,7 @@ namespace simference
 		{
 			// Compare against only non-descendants
 			if (!weight->isDescendantOf(rod))
-			{
-				RealNum c = rod->collision(weight);
-				summary.rodXweight += c;
-				summary.rodXweightN += (c > 0.0);
-			}
+				candidatePairs.push_back(CollisionPair(rod, weight, RodXWeight));
 		}
 
 		// weight vs. string
@@ -276,11 +352,7 @@ namespace simference
 		{
 			// Compare against only non-ancestors
 			if (!str->isAncestorOf(weight))
-			{
-				RealNum c = weight->collision(str);
-				summary.weightXstring += c;
-				summary.weightXstringN += (c > 0.0);
-			}
+				candidatePairs.push_back(CollisionPair(weight, str, WeightXString));
 		}
 
 		// weight vs. weight
@@ -291,18 +363,70 @@ namespace simference
 				for (unsigned int j = i+1; j < weights.size(); j++)
 				{
 					// Have to check against every other weight, unfortunately
-					RealNum c = weights[i]->collision(weights[j]);
-					summary.weightXweight += c;
-					summary.weightXweightN += (c > 0.0);
+					candidatePairs.push_back(CollisionPair(weights[i], weights[j], WeightXWeight));
 				}
 			}
 		}
+	}
+
+	template<typename RealNum, int Dim>
+	RealNum Mobile<RealNum, Dim>::CollisionPair::collision() const
+	{
+		switch (type)
+		{
+		case RodXRod:
+			return static_cast<RodComponent*>(first)->collision(static_cast<RodComponent*>(second));
+		case RodXString:
+			return static_cast<RodComponent*>(first)->collision(static_cast<StringComponent*>(second));
+		case RodXWeight:
+			return static_cast<RodComponent*>(first)->collision(static_cast<WeightComponent*>(second));
+		case WeightXString:
+			return static_cast<WeightComponent*>(first)->collision(static_cast<StringComponent*>(second));
+		case WeightXWeight:
+			return static_cast<WeightComponent*>(first)->collision(static_cast<WeightComponent*>(second));
+		default:
+			throw "Mobile::CollisionPair::collision - Unknown collision type!";
+		}
+	}
+
+	template<typename RealNum, int Dim>
+	typename Mobile<RealNum, Dim>::CollisionSummary Mobile<RealNum, Dim>::checkStaticCollisions() const
+	{
+		CollisionSummary summary;
+
+		for (const auto& p : candidatePairs)
+		{
+			RealNum c = p.collision();
+			switch (p.type)
+			{
+			case RodXRod:
+				summary.rodXrod += c;
+				summary.rodXrodN += (c > 0.0);
+				break;
+			case RodXString:
+				summary.rodXstring += c;
+				summary.rodXstringN += (c > 0.0);
+				break;
+			case RodXWeight:
+				summary.rodXweight += c;
+				summary.rodXweightN += (c > 0.0);
+				break;
+			case WeightXString:
+				summary.weightXstring += c;
+				summary.weightXstringN += (c > 0.0);
+				break;
+			case WeightXWeight:
+				summary.weightXweight += c;
+				summary.weightXweightN += (c > 0.0);
+				break;
+			}
+		}
 
 		return summary;
 	}
 
-	template<typename RealNum> 
-	bool Mobile<RealNum>::sanityCheckNodeCodes() const
+	template<typename RealNum, int Dim> 
+	bool Mobile<RealNum, Dim>::sanityCheckNodeCodes() const
 	{
 		function<bool(Component*, vector<Component*>&)> helper =
 			[&helper](Component* node, vector<Component*>& path) -> bool
@@ -345,8 +469,8 @@ namespace simference
 		return helper(root.get(), path);
 	}
 
-	template<typename RealNum>
-	void Mobile<RealNum>::printNodeCodes() const
+	template<typename RealNum, int Dim>
+	void Mobile<RealNum, Dim>::printNodeCodes() const
 	{
 		function<void(Component*,int)> helper = [&helper](Component* node, int depth) -> void
 		{
@@ -361,27 +485,24 @@ namespace simference
 		helper(root.get(), 0);
 	}
 
-	template<typename RealNum>
-	RealNum Mobile<RealNum>::netTorqueNorm() const
+	template<typename RealNum, int Dim>
+	RealNum Mobile<RealNum, Dim>::netTorqueNorm() const
 	{
 		RealNum accum = 0.0;
-		auto rods = nodesOfType<RodComponent>();
-		for (auto rod : rods)
+		for (auto rod : rodNodes)
 		{
-			accum += rod->torque().norm();
+			accum += rod->torqueNorm();
 		}
-		return accum / rods.size();
+		return accum / rodNodes.size();
 	}
 
-	template<typename RealNum>
-	RealNum Mobile<RealNum>::softMaxTorqueNorm() const
+	template<typename RealNum, int Dim>
+	RealNum Mobile<RealNum, Dim>::softMaxTorqueNorm() const
 	{
-		RealNum accum = 0.0;
-		auto rods = nodesOfType<RodComponent>();
-		std::vector<RealNum> torqueNorms(rods.size(), 0.0);
-		for (unsigned int i = 0; i < rods.size(); i++)
+		std::vector<RealNum> torqueNorms(rodNodes.size(), 0.0);
+		for (unsigned int i = 0; i < rodNodes.size(); i++)
 		{
-			torqueNorms[i] = rods[i]->torque().norm();
+			torqueNorms[i] = rodNodes[i]->torqueNorm();
 		}
 		RealNum smax = Math::softMax(torqueNorms, 5.0);
 		return smax;
@@ -397,221 +518,299 @@ namespace simference
 	#define STRING_DENSITY 1.0
 	#define ROD_DENSITY 2.0
 	#define WEIGHT_DENSITY 3.0
-	#define GRAVITY Vector3r(0.0, -9.8, 0.0)
+	#define GRAVITY_Y (-9.8)
 
-	template<typename RealNum>
-	void Mobile<RealNum>::StringComponent::render() const
+	// Mass and collision measures of mobile components, in terms of their scalar parameters and
+	// (planar) anchor coordinates. Shared by Mobile and CompiledMobile.
+	// Rods are given by the x coordinate of their left end, their height and their length;
+	// strings by their top anchor and length; weights by their top anchor and radius.
+	namespace MobileGeometry
+	{
+		template<typename RealNum>
+		RealNum stringMass(RealNum length)
+		{
+			// Volume: pi r^2 l
+			return STRING_RADIUS*STRING_RADIUS * Math::Pi * length * STRING_DENSITY;
+		}
+
+		template<typename RealNum>
+		RealNum rodMass(RealNum length)
+		{
+			// Volume: pi r^2 l
+			return ROD_RADIUS*ROD_RADIUS * Math::Pi * length * ROD_DENSITY;
+		}
+
+		template<typename RealNum>
+		RealNum weightMass(RealNum radius)
+		{
+			// Volume = 4/3 pi r^3
+			return 1.3333 * Math::Pi * radius*radius*radius * WEIGHT_DENSITY;
+		}
+
+		// Moment about the rod's connect point of the loads hanging from its ends
+		// (only its z component is nonzero)
+		template<typename RealNum>
+		RealNum rodTorque(RealNum scaledConnectPoint, RealNum length, RealNum leftMass, RealNum rightMass)
+		{
+			return -scaledConnectPoint * (leftMass * GRAVITY_Y) + (length - scaledConnectPoint) * (rightMass * GRAVITY_Y);
+		}
+
+		template<typename RealNum>
+		RealNum rodTorqueNorm(RealNum scaledConnectPoint, RealNum length, RealNum leftMass, RealNum rightMass)
+		{
+			using std::fabs;
+			return fabs(rodTorque(scaledConnectPoint, length, leftMass, rightMass));
+		}
+
+		template<typename RealNum>
+		RealNum rodRodCollision(RealNum xs1, RealNum y1, RealNum length1, RealNum xs2, RealNum y2, RealNum length2)
+		{
+			// collision == overlap interval (linear)
+			if (Math::intervalsOverlap(y1 - ROD_RADIUS, y1 + ROD_RADIUS, y2 - ROD_RADIUS, y2 + ROD_RADIUS))
+				return Math::intervalOverlapAmount(xs1, xs1 + length1, xs2, xs2 + length2);
+			else return 0.0;
+		}
+
+		template<typename RealNum>
+		RealNum rodStringCollision(RealNum xs, RealNum y, RealNum length, RealNum sx, RealNum sy, RealNum slength)
+		{
+			// collision == min distance from intersection point
+			// to any endpoint of either party (linear)
+			RealNum re = xs + length;
+			RealNum se = sy - slength;
+			if ((sx > xs && sx < re) && (se < y && sy > y))
+			{
+				return min(sx - xs, min(re - sx, min(sy - y, y - se)));
+			}
+			else return 0.0;
+		}
+
+		template<typename RealNum>
+		RealNum rodWeightCollision(RealNum xs, RealNum y, RealNum length, RealNum wx, RealNum wy, RealNum radius)
+		{
+			// collision == chord length (linear)
+			RealNum cy = wy - radius;
+			RealNum a = 1.0;
+			RealNum b = 2*(xs - wx);
+			RealNum c = (xs*xs + y*y) - 2*(xs*wx + y*cy) + (wx*wx + cy*cy) - radius*radius;
+			RealNum r1, r2;
+			int detsign = Math::solveQuadratic(a, b, c, r1, r2);
+			if (detsign > 0)
+				return Math::intervalOverlapAmount(xs, xs + length, xs + r1, xs + r2);
+			else return 0.0;
+		}
+
+		template<typename RealNum>
+		RealNum weightStringCollision(RealNum wx, RealNum wy, RealNum radius, RealNum sx, RealNum sy, RealNum slength)
+		{
+			// Collision = chord length
+			RealNum py = sy - slength;
+			RealNum cy = wy - radius;
+			RealNum a = 1.0;
+			RealNum b = 2*(py - cy);
+			RealNum c = (sx*sx + py*py) - 2*(sx*wx + py*cy) + (wx*wx + cy*cy) - radius*radius;
+			RealNum r1, r2;
+			int detsign = Math::solveQuadratic(a, b, c, r1, r2);
+			if (detsign > 0)
+				return Math::intervalOverlapAmount(py, py + slength, py + r1, py + r2);
+			else return 0.0;
+		}
+
+		template<typename RealNum>
+		RealNum weightWeightCollision(RealNum x1, RealNum y1, RealNum radius1, RealNum x2, RealNum y2, RealNum radius2)
+		{
+			using std::sqrt;
+			// collision = penetration distance
+			RealNum dx = x1 - x2;
+			RealNum dy = (y1 - radius1) - (y2 - radius2);
+			RealNum d = sqrt(dx*dx + dy*dy);
+			RealNum r = radius1 + radius2;
+			return max(r-d, (RealNum)0.0);
+		}
+
+		// Overloads for vars that record each measure as a single node, with
+		// hand-derived partials (see Mobile.cpp)
+		stan::agrad::var rodTorqueNorm(const stan::agrad::var& scaledConnectPoint, const stan::agrad::var& length,
+			const stan::agrad::var& leftMass, const stan::agrad::var& rightMass);
+		stan::agrad::var rodRodCollision(const stan::agrad::var& xs1, const stan::agrad::var& y1, const stan::agrad::var& length1,
+			const stan::agrad::var& xs2, const stan::agrad::var& y2, const stan::agrad::var& length2);
+		stan::agrad::var rodStringCollision(const stan::agrad::var& xs, const stan::agrad::var& y, const stan::agrad::var& length,
+			const stan::agrad::var& sx, const stan::agrad::var& sy, const stan::agrad::var& slength);
+		stan::agrad::var rodWeightCollision(const stan::agrad::var& xs, const stan::agrad::var& y, const stan::agrad::var& length,
+			const stan::agrad::var& wx, const stan::agrad::var& wy, const stan::agrad::var& radius);
+		stan::agrad::var weightStringCollision(const stan::agrad::var& wx, const stan::agrad::var& wy, const stan::agrad::var& radius,
+			const stan::agrad::var& sx, const stan::agrad::var& sy, const stan::agrad::var& slength);
+		stan::agrad::var weightWeightCollision(const stan::agrad::var& x1, const stan::agrad::var& y1, const stan::agrad::var& radius1,
+			const stan::agrad::var& x2, const stan::agrad::var& y2, const stan::agrad::var& radius2);
+
+		// The measures in double, with their partials w.r.t. all of their arguments (packed into 'x', in the
+		// order above). They return false where the measure is identically zero, leaving 'value' and 'partials' unset.
+		bool rodTorqueNorm(const double* x, double& value, double* partials);
+		bool rodRodCollision(const double* x, double& value, double* partials);
+		bool rodStringCollision(const double* x, double& value, double* partials);
+		bool rodWeightCollision(const double* x, double& value, double* partials);
+		bool weightStringCollision(const double* x, double& value, double* partials);
+		bool weightWeightCollision(const double* x, double& value, double* partials);
+
+		// Overloads for recorded scalars, where each measure is a single kernel call (built on the above), so
+		// that whether (and how) things collide doesn't put any guards on the tape
+		AD::Recorded rodTorqueNorm(const AD::Recorded& scaledConnectPoint, const AD::Recorded& length,
+			const AD::Recorded& leftMass, const AD::Recorded& rightMass);
+		AD::Recorded rodRodCollision(const AD::Recorded& xs1, const AD::Recorded& y1, const AD::Recorded& length1,
+			const AD::Recorded& xs2, const AD::Recorded& y2, const AD::Recorded& length2);
+		AD::Recorded rodStringCollision(const AD::Recorded& xs, const AD::Recorded& y, const AD::Recorded& length,
+			const AD::Recorded& sx, const AD::Recorded& sy, const AD::Recorded& slength);
+		AD::Recorded rodWeightCollision(const AD::Recorded& xs, const AD::Recorded& y, const AD::Recorded& length,
+			const AD::Recorded& wx, const AD::Recorded& wy, const AD::Recorded& radius);
+		AD::Recorded weightStringCollision(const AD::Recorded& wx, const AD::Recorded& wy, const AD::Recorded& radius,
+			const AD::Recorded& sx, const AD::Recorded& sy, const AD::Recorded& slength);
+		AD::Recorded weightWeightCollision(const AD::Recorded& x1, const AD::Recorded& y1, const AD::Recorded& radius1,
+			const AD::Recorded& x2, const AD::Recorded& y2, const AD::Recorded& radius2);
+	}
+
+	template<typename RealNum, int Dim>
+	void Mobile<RealNum, Dim>::StringComponent::render() const
 	{
 		SET_STRING_COLOR;
 		glMatrixMode(GL_MODELVIEW);
 		glPushMatrix();
-		glTranslatef(anchor.x(), anchor.y(), anchor.z());
+		Eigen::Vector3d a = this->anchorPoint();
+		glTranslatef(a.x(), a.y(), a.z());
 		glRotatef(90.0f, 1.0f, 0.0f, 0.0f);
-		gluCylinder(quadric, STRING_RADIUS, STRING_RADIUS, sym->params[StringLength], RADIAL_SLICES, 1);
+		gluCylinder(quadric, STRING_RADIUS, STRING_RADIUS, valueOf(sym->params[StringLength]), RADIAL_SLICES, 1);
 		glPopMatrix();
 
 		child->render();
 	}
-	// Specialization (see Mobile.cpp)
-	template<> void Mobile<stan::agrad::var>::StringComponent::render() const;
 
-	template<typename RealNum>
-	RealNum Mobile<RealNum>::StringComponent::mass() const
+	template<typename RealNum, int Dim>
+	void Mobile<RealNum, Dim>::StringComponent::aggregateMass()
 	{
-		// Volume: pi r^2 l
-		return STRING_RADIUS*STRING_RADIUS * Math::Pi * sym->params[StringLength] * STRING_DENSITY
-			+ child->mass();
+		this->subtreeMass = MobileGeometry::stringMass(sym->params[StringLength]) + child->mass();
 	}
 
-	template<typename RealNum>
-	void Mobile<RealNum>::StringComponent::updateAnchors(const Vector3r& a)
+	template<typename RealNum, int Dim>
+	void Mobile<RealNum, Dim>::StringComponent::updateAnchors(const VectorNr& a)
 	{
 		Component::updateAnchors(a);
-		child->updateAnchors(a - Vector3r(0.0, sym->params[StringLength], 0.0));
+		VectorNr bottom = a; bottom.y() -= sym->params[StringLength];
+		child->updateAnchors(bottom);
 	}
 
-	template<typename RealNum>
-	void Mobile<RealNum>::WeightComponent::render() const
+	template<typename RealNum, int Dim>
+	void Mobile<RealNum, Dim>::WeightComponent::render() const
 	{
 		glMatrixMode(GL_MODELVIEW);
 		glPushMatrix();
 
-		RealNum radius = sym->params[WeightRadius];
+		double radius = valueOf(sym->params[WeightRadius]);
 
 		// Push down by the radius
-		glTranslatef(anchor.x(), anchor.y()-radius, anchor.z());
+		Eigen::Vector3d a = this->anchorPoint();
+		glTranslatef(a.x(), a.y()-radius, a.z());
 
 		// Draw a weight as a sphere
 		SET_WEIGHT_COLOR;
 		glutSolidSphere(radius, RADIAL_SLICES, RADIAL_SLICES);
 		glPopMatrix();
 	}
-	// Specialization (see Mobile.cpp)
-	template<> void Mobile<stan::agrad::var>::WeightComponent::render() const;
 
-	template<typename RealNum>
-	RealNum Mobile<RealNum>::WeightComponent::mass() const
+	template<typename RealNum, int Dim>
+	void Mobile<RealNum, Dim>::WeightComponent::aggregateMass()
 	{
-		// Volume = 4/3 pi r^3
-		RealNum radius = sym->params[WeightRadius];
-		return 1.3333 * Math::Pi * radius*radius*radius * WEIGHT_DENSITY;
+		this->subtreeMass = MobileGeometry::weightMass(sym->params[WeightRadius]);
 	}
 
-	template<typename RealNum>
-	RealNum Mobile<RealNum>::WeightComponent::collision(StringComponent* str) const
+	template<typename RealNum, int Dim>
+	RealNum Mobile<RealNum, Dim>::WeightComponent::collision(StringComponent* str) const
 	{
-		RealNum radius = sym->params[WeightRadius];
-		RealNum length = str->sym->params[StringLength];
-
-		// Collision = chord length
-		Vector3r p = str->anchor; p.y() -= length;
-		Vector3r center = anchor; center.y() -= radius;
-		RealNum a = 1.0;
-		RealNum b = 2*(p.y() - center.y());
-		RealNum c = p.dot(p) - 2*p.dot(center) + center.dot(center) - radius*radius;
-		RealNum r1, r2;
-		int detsign = Math::solveQuadratic(a, b, c, r1, r2);
-		if (detsign > 0)
-		{
-			RealNum ss = p.y();
-			RealNum se = ss + length;
-			RealNum ys = p.y() + r1;
-			RealNum ye = p.y() + r2;
-			return Math::intervalOverlapAmount(ss, se, ys, ye);
-		}
-		else return 0.0;
+		return MobileGeometry::weightStringCollision(this->anchor.x(), this->anchor.y(), sym->params[WeightRadius],
+			str->anchor.x(), str->anchor.y(), str->sym->params[StringLength]);
 	}
 
-	template<typename RealNum>
-	RealNum Mobile<RealNum>::WeightComponent::collision(WeightComponent* weight) const
+	template<typename RealNum, int Dim>
+	RealNum Mobile<RealNum, Dim>::WeightComponent::collision(WeightComponent* weight) const
 	{
 		// Sanity check
 		if (this == weight) return 0.0;
 
-		RealNum radius1 = sym->params[WeightRadius];
-		RealNum radius2 = weight->sym->params[WeightRadius];
-
-		// collision = penetration distance
-		Vector3r c1 = anchor; c1.y() -= radius1;
-		Vector3r c2 = weight->anchor; c2.y() -= radius2;
-		RealNum d = (c1-c2).norm();
-		RealNum r = radius1 + radius2;
-		return max(r-d, (RealNum)0.0);
+		return MobileGeometry::weightWeightCollision(this->anchor.x(), this->anchor.y(), sym->params[WeightRadius],
+			weight->anchor.x(), weight->anchor.y(), weight->sym->params[WeightRadius]);
 	}
 
-	template<typename RealNum>
-	void Mobile<RealNum>::RodComponent::render() const
+	template<typename RealNum, int Dim>
+	void Mobile<RealNum, Dim>::RodComponent::render() const
 	{
 		// Draw a rod
 		SET_ROD_COLOR;
 		glMatrixMode(GL_MODELVIEW);
 		glPushMatrix();
-		glTranslatef(anchor.x()-scaledConnectPoint(), anchor.y(), anchor.z());
+		Eigen::Vector3d a = this->anchorPoint();
+		glTranslatef(a.x()-valueOf(scaledConnectPoint()), a.y(), a.z());
 		glRotatef(90.0f, 0.0f, 1.0f, 0.0f);
-		gluCylinder(quadric, ROD_RADIUS, ROD_RADIUS, sym->params[RodLength], RADIAL_SLICES, 1);
+		gluCylinder(quadric, ROD_RADIUS, ROD_RADIUS, valueOf(sym->params[RodLength]), RADIAL_SLICES, 1);
 		glPopMatrix();
 
 		leftChild->render();
 		rightChild->render();
 	}
-	// Specialization (see Mobile.cpp)
-	template<> void Mobile<stan::agrad::var>::RodComponent::render() const;
 
-	template<typename RealNum>
-	RealNum Mobile<RealNum>::RodComponent::mass() const
+	template<typename RealNum, int Dim>
+	void Mobile<RealNum, Dim>::RodComponent::aggregateMass()
 	{
-		// Volume: pi r^2 l
-		return ROD_RADIUS*ROD_RADIUS * Math::Pi * sym->params[RodLength] * ROD_DENSITY
-			+ leftChild->mass() + rightChild->mass();
+		this->subtreeMass = MobileGeometry::rodMass(sym->params[RodLength]) + leftChild->mass() + rightChild->mass();
 	}
 
-	template<typename RealNum>
-	void Mobile<RealNum>::RodComponent::updateAnchors(const Vector3r& a)
+	template<typename RealNum, int Dim>
+	void Mobile<RealNum, Dim>::RodComponent::updateAnchors(const VectorNr& a)
 	{
 		Component::updateAnchors(a);
-		Vector3r lp = a - Vector3r(scaledConnectPoint(), 0.0, 0.0);
-		Vector3r rp = lp + Vector3r(sym->params[RodLength], 0.0, 0.0);
+		VectorNr lp = a; lp.x() -= scaledConnectPoint();
+		VectorNr rp = lp; rp.x() += sym->params[RodLength];
 		leftChild->updateAnchors(lp);
 		rightChild->updateAnchors(rp);
 	}
 
-	template<typename RealNum>
-	typename Mobile<RealNum>::Vector3r Mobile<RealNum>::RodComponent::torque() const
+	template<typename RealNum, int Dim>
+	typename Mobile<RealNum, Dim>::Torque Mobile<RealNum, Dim>::RodComponent::torque() const
 	{
-		Vector3r lp = anchor; lp.x() -= scaledConnectPoint();
-		Vector3r rp = lp; rp.x() += sym->params[RodLength];
-		Vector3r d1 = lp - anchor;
-		Vector3r d2 = rp - anchor;
-		Vector3r f1 = leftChild->mass() * GRAVITY;
-		Vector3r f2 = rightChild->mass() * GRAVITY;
-		return d1.cross(f1) + d2.cross(f2);
+		// The lever arms are along x and the loads along y, so the torque is all about z
+		return MobileTorque<RealNum, Dim>::fromMoment(MobileGeometry::rodTorque(scaledConnectPoint(),
+			sym->params[RodLength], leftChild->mass(), rightChild->mass()));
 	}
 
-	template<typename RealNum>
-	RealNum Mobile<RealNum>::RodComponent::collision(RodComponent* rod) const
+	template<typename RealNum, int Dim>
+	RealNum Mobile<RealNum, Dim>::RodComponent::torqueNorm() const
+	{
+		return MobileGeometry::rodTorqueNorm(scaledConnectPoint(), sym->params[RodLength], leftChild->mass(), rightChild->mass());
+	}
+
+	template<typename RealNum, int Dim>
+	RealNum Mobile<RealNum, Dim>::RodComponent::collision(RodComponent* rod) const
 	{
 		// Sanity check
 		if (this == rod) return 0.0;
 
-		// collision == overlap interval (linear)
-		RealNum ymin1 = anchor.y() - ROD_RADIUS;
-		RealNum ymax1 = anchor.y() + ROD_RADIUS;
-		RealNum ymin2 = rod->anchor.y() - ROD_RADIUS;
-		RealNum ymax2 = rod->anchor.y() + ROD_RADIUS;
-		if (Math::intervalsOverlap(ymin1, ymax1, ymin2, ymax2))
-		{
-			RealNum xmin1 = anchor.x() - scaledConnectPoint();
-			RealNum xmax1 = xmin1 + sym->params[RodLength];
-			RealNum xmin2 = rod->anchor.x() - rod->scaledConnectPoint();
-			RealNum xmax2 = xmin2 + rod->sym->params[RodLength];
-			return Math::intervalOverlapAmount(xmin1, xmax1, xmin2, xmax2);
-		}
-		else return 0.0;
+		return MobileGeometry::rodRodCollision(this->anchor.x() - scaledConnectPoint(), this->anchor.y(), sym->params[RodLength],
+			rod->anchor.x() - rod->scaledConnectPoint(), rod->anchor.y(), rod->sym->params[RodLength]);
 	}
 
-	template<typename RealNum>
-	RealNum Mobile<RealNum>::RodComponent::collision(StringComponent* str) const
+	template<typename RealNum, int Dim>
+	RealNum Mobile<RealNum, Dim>::RodComponent::collision(StringComponent* str) const
 	{
-		// collision == min distance from intersection point
-		// to any endpoint of either party (linear)
-		RealNum x = str->anchor.x();
-		RealNum rs = anchor.x() - scaledConnectPoint();
-		RealNum re = rs + sym->params[RodLength];
-		RealNum y = anchor.y();
-		RealNum ss = str->anchor.y();
-		RealNum se = str->anchor.y() - str->sym->params[StringLength];
-		if ((x > rs && x < re) && (se < y && ss > y))
-		{
-			return min(x - rs, min(re - x, min(ss - y, y - se)));
-		}
-		else return 0.0;
+		return MobileGeometry::rodStringCollision(this->anchor.x() - scaledConnectPoint(), this->anchor.y(), sym->params[RodLength],
+			str->anchor.x(), str->anchor.y(), str->sym->params[StringLength]);
 	}
 
-	template<typename RealNum>
-	RealNum Mobile<RealNum>::RodComponent::collision(WeightComponent* weight) const
+	template<typename RealNum, int Dim>
+	RealNum Mobile<RealNum, Dim>::RodComponent::collision(WeightComponent* weight) const
 	{
-		RealNum radius = weight->sym->params[WeightRadius];
-		// collision == chord length (linear)
-		Vector3r p = anchor; p.x() -= scaledConnectPoint();
-		Vector3r center = weight->anchor; center.y() -= radius;
-		RealNum a = 1.0;
-		RealNum b = 2*(p.x() - center.x());
-		RealNum c = p.dot(p) - 2*p.dot(center) + center.dot(center) - radius*radius;
-		RealNum r1, r2;
-		int detsign = Math::solveQuadratic(a, b, c, r1, r2);
-		if (detsign > 0)
-		{
-			RealNum rs = p.x();
-			RealNum re = rs + sym->params[RodLength];
-			RealNum xs = p.x() + r1;
-			RealNum xe = p.x() + r2;
-			return Math::intervalOverlapAmount(rs, re, xs, xe);
-		}
-		else return 0.0;
+		return MobileGeometry::rodWeightCollision(this->anchor.x() - scaledConnectPoint(), this->anchor.y(), sym->params[RodLength],
+			weight->anchor.x(), weight->anchor.y(), weight->sym->params[WeightRadius]);
 	}
 
-	template<typename RealNum>
-	void Mobile<RealNum>::CollisionSummary::print() const
+	template<typename RealNum, int Dim>
+	void Mobile<RealNum, Dim>::CollisionSummary::print() const
 	{
 		cout << "Mobile static collision summary:" << endl;
 		cout << "--------------------------------" << endl;
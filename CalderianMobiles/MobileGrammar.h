@@ -9,6 +9,14 @@ namespace simference
 	{
 		namespace MobileGrammar
 		{
+			enum MobileSymbolKindBits
+			{
+				StringKind = FirstGrammarKind,
+				RodKind = FirstGrammarKind << 1,
+				WeightKind = FirstGrammarKind << 2,
+				StringEndpointKind = FirstGrammarKind << 3
+			};
+
 			template <typename RealNum>
 			class Parameters
 			{
@@ -23,116 +31,107 @@ namespace simference
 					//rodConnect(0.5, 0.07),
 					//weightRadius(0.5, 0.1),
 					maxDepth(5) {}
-				static Parameters<RealNum>* instance;
 
 			public:
-				TruncatedNormalDistribution<RealNum, double> stringLength;
-				TruncatedNormalDistribution<RealNum, double> rodLength;
-				TruncatedNormalDistribution<RealNum, double> rodConnect;
-				TruncatedNormalDistribution<RealNum, double> weightRadius;
+				typedef TruncatedNormalDistribution<RealNum, double> Prior;
+				Prior stringLength;
+				Prior rodLength;
+				Prior rodConnect;
+				Prior weightRadius;
 				//NormalDistribution<RealNum, double> stringLength;
 				//NormalDistribution<RealNum, double> rodLength;
 				//NormalDistribution<RealNum, double> rodConnect;
 				//NormalDistribution<RealNum, double> weightRadius;
 				unsigned int maxDepth;
-				static Parameters* Instance() { if (instance == NULL) {instance = new Parameters<RealNum>;} return instance;}
+				static Parameters* Instance() { static Parameters<RealNum> instance; return &instance; }
 			};
-			template <typename RealNum> Parameters<RealNum>* Parameters<RealNum>::instance = NULL;
 
 			template <typename RealNum>
-			class StringTerminal : public GeneralTerminal<RealNum, 1>
+			class StringTerminal : public GeneralTerminal<RealNum, 1, typename Parameters<RealNum>::Prior>
 			{
 			public:
-				StringTerminal(unsigned int depth, unsigned int id) : GeneralTerminal(depth, GetDistribs()), index(id) {}
+				enum { KindBit = StringKind };
+				StringTerminal(unsigned int depth, unsigned int id) : GeneralTerminal(depth, GetDistribs()), index(id) { this->kinds |= KindBit; }
 				char* name() const { return "String"; }
 				StringTerminal<RealNum>* copy() const { return new StringTerminal<RealNum>(depth, index); }
+				StringTerminal<double>* valueCopy() const { return new StringTerminal<double>(depth, index); }
 				unsigned int index;
-				static Distribution<RealNum>* distribs[1];
-				static Distribution<RealNum>** GetDistribs()
+				static typename Parameters<RealNum>::Prior* const* GetDistribs()
 				{
-					if (distribs[0] == NULL) { distribs[0] = &Parameters<RealNum>::Instance()->stringLength; }
+					static typename Parameters<RealNum>::Prior* const distribs[1] = { &Parameters<RealNum>::Instance()->stringLength };
 					return distribs;
 				}
 			};
-			template <typename RealNum> Distribution<RealNum>* StringTerminal<RealNum>::distribs[1] = {NULL};
 			enum StringTerminalParamIndices { StringLength = 0 };
 
 			template <typename RealNum>
-			class RodTerminal : public GeneralTerminal<RealNum, 2>
+			class RodTerminal : public GeneralTerminal<RealNum, 2, typename Parameters<RealNum>::Prior>
 			{
 			public:
-				RodTerminal(unsigned int depth) : GeneralTerminal(depth, GetDistribs()) {}
+				enum { KindBit = RodKind };
+				RodTerminal(unsigned int depth) : GeneralTerminal(depth, GetDistribs()) { this->kinds |= KindBit; }
 				char* name() const { return "Rod"; }
 				RodTerminal<RealNum>* copy() const { return new RodTerminal<RealNum>(depth); }
-				static Distribution<RealNum>* distribs[2];
-				static Distribution<RealNum>** GetDistribs()
+				RodTerminal<double>* valueCopy() const { return new RodTerminal<double>(depth); }
+				static typename Parameters<RealNum>::Prior* const* GetDistribs()
 				{
-					if (distribs[0] == NULL) { distribs[0] = &Parameters<RealNum>::Instance()->rodLength; distribs[1] = &Parameters<RealNum>::Instance()->rodConnect; }
+					static typename Parameters<RealNum>::Prior* const distribs[2] = { &Parameters<RealNum>::Instance()->rodLength, &Parameters<RealNum>::Instance()->rodConnect };
 					return distribs;
 				}
 			};
-			template<typename RealNum> Distribution<RealNum>* RodTerminal<RealNum>::distribs[2] = { NULL, NULL};
 			enum RodTerminalParamIndices { RodLength = 0, RodConnectPoint };
 
 			template <typename RealNum>
-			class WeightTerminal : public GeneralTerminal<RealNum, 1>
+			class WeightTerminal : public GeneralTerminal<RealNum, 1, typename Parameters<RealNum>::Prior>
 			{
 			public:
-				WeightTerminal(unsigned int depth) : GeneralTerminal(depth, GetDistribs()) {}
+				enum { KindBit = WeightKind };
+				WeightTerminal(unsigned int depth) : GeneralTerminal(depth, GetDistribs()) { this->kinds |= KindBit; }
 				char* name() const { return "Weight"; }
 				WeightTerminal<RealNum>* copy() const { return new WeightTerminal<RealNum>(depth); }
-				static Distribution<RealNum>* distribs[1];
-				static Distribution<RealNum>** GetDistribs()
+				WeightTerminal<double>* valueCopy() const { return new WeightTerminal<double>(depth); }
+				static typename Parameters<RealNum>::Prior* const* GetDistribs()
 				{
-					if (distribs[0] == NULL) { distribs[0] = &Parameters<RealNum>::Instance()->weightRadius; }
+					static typename Parameters<RealNum>::Prior* const distribs[1] = { &Parameters<RealNum>::Instance()->weightRadius };
 					return distribs;
 				}
 			};
-			template<typename RealNum> Distribution<RealNum>* WeightTerminal<RealNum>::distribs[1] = { NULL };
 			enum WeightTerminalParamIndices { WeightRadius = 0 };
 
 			template <typename RealNum>
-			class StringEndpointVariable : public Variable<RealNum>
+			class StringEndpointVariable : public TableVariable<RealNum, StringEndpointVariable<RealNum>>
 			{
 			public:
 
 				typedef typename SymbolPtr<RealNum>::type SymPtr;
 
-				StringEndpointVariable(unsigned int depth) : Variable(depth) {}
+				enum { KindBit = StringEndpointKind };
+				StringEndpointVariable(unsigned int depth) : TableVariable(depth) { this->kinds |= KindBit; }
+
+				// Productions:
+				// 0) Stick a terminal weight at the end of this string
+				// 1) Stick a rod, plus the beginnings of its two branches, onto the end of this string
+				enum { WeightProduction = 0, RodProduction, NumProductions };
 
-				static std::vector<Production<RealNum>> InitProductionList()
+				// Both rules can always be applied
+				static bool applicable(unsigned int i, const StringEndpointVariable<RealNum>& v) { return true; }
+
+				// A weight gets more likely as depth increases, a rod less likely
+				static double probability(unsigned int i, const StringEndpointVariable<RealNum>& v)
 				{
-					std::vector<Production<RealNum>> p;
-					// 1) Stick a terminal weight at the end of this string
-					p.push_back(Production<RealNum>(
-						// Conditional expression: this rule can always be applied
-						[](const Variable<RealNum>& v) { return true; },
-						// Probability expression: this rule gets more likely as depth increases
-						[](const Variable<RealNum>& v)
-					{
-						return v.depth / (RealNum)(Parameters<RealNum>::Instance()->maxDepth);
-					},
-						// Unroll expression: replace the variable with a terminal weight with randomly-sampled mass
-						[](const Variable<RealNum>& v)
+					double weightProb = v.depth / (double)(Parameters<RealNum>::Instance()->maxDepth);
+					return i == WeightProduction ? weightProb : 1.0 - weightProb;
+				}
+
+				static void rightHandSide(unsigned int i, const StringEndpointVariable<RealNum>& v, std::vector<SymPtr>& s)
+				{
+					if (i == WeightProduction)
 					{
-						std::vector<SymPtr> s;
+						// A terminal weight with randomly-sampled mass
 						s.push_back(SymPtr(new WeightTerminal<RealNum>(v.depth+1)));
-						return s;
 					}
-					));
-					// 2) Stick a rod, plus the beginnings of its two branches, onto the end of this string
-					p.push_back(Production<RealNum>(
-						// Conditional expression: this rule can always be applied
-						[](const Variable<RealNum>& v) { return true; },
-						// Probability expression: this rule gets less likely as depth increases
-						[](const Variable<RealNum>& v)
-					{
-						return 1.0 - v.depth / (RealNum)(Parameters<RealNum>::Instance()->maxDepth);
-					},
-						// Unroll expression
-						[](const Variable<RealNum>& v)
+					else
 					{
-						std::vector<SymPtr> s;
 						// Rod
 						s.push_back(SymPtr(new RodTerminal<RealNum>(v.depth+1)));
 						// Left branch
@@ -141,10 +140,7 @@ namespace simference
 						// Right branch
 						s.push_back(SymPtr(new StringTerminal<RealNum>(v.depth+1, 1)));
 						s.push_back(SymPtr(new StringEndpointVariable<RealNum>(v.depth+1)));
-						return s;
 					}
-					));
-					return p;
 				}
 
 				StringEndpointVariable<RealNum>* copy() const
@@ -152,15 +148,16 @@ namespace simference
 					return new StringEndpointVariable<RealNum>(depth);
 				}
 
-				const std::vector<Production<RealNum>>& productions() const { return productionList; }
+				StringEndpointVariable<double>* valueCopy() const
+				{
+					return new StringEndpointVariable<double>(depth);
+				}
 
-				void print(std::ostream& outstream) const { outstream << "SVar(" << depth << ")"; }
+				// The two branches hanging off a rod are mirror images of one another
+				bool mirrorSymmetricChildren() const { return true; }
 
-				static std::vector<Production<RealNum>> productionList;
+				void print(std::ostream& outstream) const { outstream << "SVar(" << depth << ")"; }
 			};
-
-			template<typename RealNum>
-			std::vector<Production<RealNum>> StringEndpointVariable<RealNum>::productionList = StringEndpointVariable<RealNum>::InitProductionList();
 		}
 	}
 }
@@ -1,4 +1,6 @@
 #include "MobileModel.h"
+#include <cassert>
+#include <unordered_set>
 
 using namespace std;
 using namespace simference::Grammar;
@@ -11,45 +13,241 @@ namespace simference
 {
 	namespace Models
 	{
+		// Kernel bandwidths (before scaling) for the collision terms, indexed by Mobile::CollisionType,
+		// and for the torque terms
+		static const double CollisionSD[] = { 0.328407, 1.10272, 0.883831, 1.20902, 0.807079 };
+		static const double TorqueSD = 360.0;
+
 		void MobileFactorTemplate::unroll(StructurePtr s, vector<FactorPtr>& factors) const
 		{
-			factors.push_back(FactorPtr(new Factor(s, anchor)));
+			if (decomposed)
+				factors.push_back(FactorPtr(new TermsFactor(s, anchor)));
+			else
+				factors.push_back(FactorPtr(new Factor(s, anchor)));
+		}
+
+		void MobileFactorTemplate::unroll(StructurePtr sOld, StructurePtr sNew,
+			vector<FactorPtr>& fOld, vector<FactorPtr>& fNew, vector<FactorPtr>& fShared) const
+		{
+			// The aggregate factor doesn't decompose, so we can't do better than the default.
+			if (!decomposed)
+			{
+				FactorTemplate::unroll(sOld, sNew, fOld, fNew, fShared);
+				return;
+			}
+
+			auto dtNew = static_pointer_cast<DerivationTree<var>>(sNew);
+			assert(dtNew->provenance.modifiedFrom == sOld);
+
+			// Terms that don't touch the rerolled subtree have the same value under both structures.
+			fOld.push_back(FactorPtr(new TermsFactor(sOld, anchor, dtNew->provenance.oldSubtreeRoot, TermsFactor::TermsTouchingSubtree)));
+			fNew.push_back(FactorPtr(new TermsFactor(sNew, anchor, dtNew->provenance.newSubtreeRoot, TermsFactor::TermsTouchingSubtree)));
+			fShared.push_back(FactorPtr(new TermsFactor(sOld, anchor, dtNew->provenance.oldSubtreeRoot, TermsFactor::TermsNotTouchingSubtree)));
 		}
 
 		MobileFactorTemplate::Factor::Factor(StructurePtr s, const Vector3d& anchor)
-			: simference::Models::Factor(s), mobile(static_pointer_cast<DerivationTree<var>>(s)->derivation, anchor)
+			: simference::Models::Factor(s), mobile(static_pointer_cast<DerivationTree<var>>(s)->derivation, anchor),
+			valueMobile(static_pointer_cast<DerivationTree<var>>(s)->derivation, anchor),
+			recordedMobile(static_pointer_cast<DerivationTree<var>>(s)->derivation, anchor)
 		{
+			segmentedKernel.factor = this;
 		}
 
 		var MobileFactorTemplate::Factor::log_prob(const ParameterVector<var>& params)
 		{
-			auto dtree = static_pointer_cast<DerivationTree<var>>(structUnrolledFrom);
-			dtree->setParams(params);
-			mobile.updateAnchors();
+			if (!segmentedGradient)
+				return evaluate(mobile, params);
+
+			unsigned int n = params.size();
+			values.resize(n);
+			gradient.resize(n);
+			for (unsigned int i = 0; i < n; i++)
+				values[i] = params[i].val();
+			double lp = valueAndGradient(ParameterVector<double>(values), gradient.data());
+			return AD::fused(lp, n, &params[0], gradient.data());
+		}
+
+		double MobileFactorTemplate::Factor::log_prob(const ParameterVector<double>& params)
+		{
+			return evaluate(valueMobile, params);
+		}
+
+		// A recording must see every candidate pair, since a pair the broad phase prunes now may collide on replay
+		AD::Recorded MobileFactorTemplate::Factor::log_prob(const ParameterVector<AD::Recorded>& params)
+		{
+			if (segmentedGradient)
+				return AD::call(segmentedKernel, params.size(), &params[0]);
+			return evaluate(recordedMobile, params, false);
+		}
 
-			var lp = 0.0;
+		// Same terms as evaluate, in the same order. The forward pass leaves the value mobile's state in
+		// place, and each block of terms then pushes its gradient onto the adjoints of that state.
+		double MobileFactorTemplate::Factor::valueAndGradient(const ParameterVector<double>& params, double* gradient)
+		{
+			valueMobile.update(params);
+			valueMobile.clearAdjoints(adjoints);
+			std::fill(gradient, gradient + params.size(), 0.0);
+
+			double lp = 0.0;
+
+			// d/dx log N(x; 0, sd) = -x/sd^2
+			if (collisionsEnabled)
+			{
+				auto collsum = valueMobile.checkStaticCollisions(broadPhaseEnabled);
+				double totals[] = { collsum.rodXrod, collsum.rodXstring, collsum.rodXweight, collsum.weightXstring, collsum.weightXweight };
+				double weights[Mobile<double>::NumCollisionTypes];
+				for (unsigned int t = 0; t < Mobile<double>::NumCollisionTypes; t++)
+				{
+					double sd = CollisionSD[t] * collisionScaleFactor;
+					lp += NormalDistribution<double>::LogProb(totals[t], 0.0, sd);
+					weights[t] = -totals[t] / (sd*sd);
+				}
+				valueMobile.collisionAdjoints(weights, broadPhaseEnabled, adjoints);
+			}
+
+			if (torqueEnabled)
+			{
+				double torqueSD = TorqueSD * torqueScaleFactor;
+				double smax = valueMobile.softMaxTorqueNorm();
+				lp += NormalDistribution<double>::LogProb(smax, 0.0, torqueSD);
+				valueMobile.torqueAdjoints(-smax / (torqueSD*torqueSD), adjoints);
+			}
+
+			valueMobile.backpropagate(params, adjoints, gradient);
+			return lp;
+		}
+
+		template<typename RealNum>
+		RealNum MobileFactorTemplate::Factor::evaluate(CompiledMobile<RealNum>& mobile, const ParameterVector<RealNum>& params,
+			bool broadPhase)
+		{
+			mobile.update(params);
+
+			RealNum lp = 0.0;
 
 			// Static collision factors
 			if (collisionsEnabled)
 			{
-				double rodXrodSD = 0.328407 * collisionScaleFactor;
-				double rodXstringSD = 1.10272 * collisionScaleFactor;
-				double rodXweightSD = 0.883831 * collisionScaleFactor;
-				double weightXstringSD = 1.20902 * collisionScaleFactor;
-				double weightXweightSD = 0.807079 * collisionScaleFactor;
-				auto collsum = mobile.checkStaticCollisions();
-				lp += NormalDistribution<var>::LogProb(collsum.rodXrod, 0.0, rodXrodSD);
-				lp += NormalDistribution<var>::LogProb(collsum.rodXstring, 0.0, rodXstringSD);
-				lp += NormalDistribution<var>::LogProb(collsum.rodXweight, 0.0, rodXweightSD);
-				lp += NormalDistribution<var>::LogProb(collsum.weightXstring, 0.0, weightXstringSD);
-				lp += NormalDistribution<var>::LogProb(collsum.weightXweight, 0.0, weightXweightSD);
+				double rodXrodSD = CollisionSD[Mobile<RealNum>::RodXRod] * collisionScaleFactor;
+				double rodXstringSD = CollisionSD[Mobile<RealNum>::RodXString] * collisionScaleFactor;
+				double rodXweightSD = CollisionSD[Mobile<RealNum>::RodXWeight] * collisionScaleFactor;
+				double weightXstringSD = CollisionSD[Mobile<RealNum>::WeightXString] * collisionScaleFactor;
+				double weightXweightSD = CollisionSD[Mobile<RealNum>::WeightXWeight] * collisionScaleFactor;
+				auto collsum = mobile.checkStaticCollisions(broadPhase);
+				lp += NormalDistribution<RealNum, double>::LogProb(collsum.rodXrod, 0.0, rodXrodSD);
+				lp += NormalDistribution<RealNum, double>::LogProb(collsum.rodXstring, 0.0, rodXstringSD);
+				lp += NormalDistribution<RealNum, double>::LogProb(collsum.rodXweight, 0.0, rodXweightSD);
+				lp += NormalDistribution<RealNum, double>::LogProb(collsum.weightXstring, 0.0, weightXstringSD);
+				lp += NormalDistribution<RealNum, double>::LogProb(collsum.weightXweight, 0.0, weightXweightSD);
 			}
 
 			// Static equilibrium factor
 			if (torqueEnabled)
 			{
-				double torqueSD = 360.0 * torqueScaleFactor;
-				lp += NormalDistribution<var>::LogProb(mobile.softMaxTorqueNorm(), 0.0, torqueSD);
+				double torqueSD = TorqueSD * torqueScaleFactor;
+				lp += NormalDistribution<RealNum, double>::LogProb(mobile.softMaxTorqueNorm(), 0.0, torqueSD);
+			}
+
+			return lp;
+		}
+
+		MobileFactorTemplate::TermsFactor::TermsFactor(StructurePtr s, const Vector3d& anchor,
+			SymbolPtr<var>::type subtreeRoot, Selection sel)
+			: simference::Models::Factor(s), mobile(static_pointer_cast<DerivationTree<var>>(s)->derivation, anchor),
+			valueMobile(static_pointer_cast<DerivationTree<var>>(s)->valueTree()->derivation, anchor)
+		{
+			const auto& rods = mobile.rods();
+			const auto& pairs = mobile.collisionPairs();
+
+			// Gather the symbols of the subtree, and find some component that belongs to it
+			// (its ancestors are exactly the ancestors of the subtree)
+			unordered_set<Symbol<var>*> subtree;
+			Mobile<var, Dim>::Component* subtreeComponent = NULL;
+			if (sel != AllTerms)
+			{
+				stack<Symbol<var>*> fringe;
+				fringe.push(subtreeRoot.get());
+				while (!fringe.empty())
+				{
+					auto sym = fringe.top();
+					fringe.pop();
+					subtree.insert(sym);
+					if (sym->numChildren() > 0)
+						for (const auto& c : sym->children())
+							fringe.push(c.get());
+				}
+				for (auto c : mobile.components())
+				{
+					if (subtree.count(c->symbol()) > 0)
+					{
+						subtreeComponent = c;
+						break;
+					}
+				}
+			}
+			auto inSubtree = [&subtree](Mobile<var, Dim>::Component* c) { return subtree.count(c->symbol()) > 0; };
+			auto keep = [sel](bool touches) { return sel == AllTerms || (touches == (sel == TermsTouchingSubtree)); };
+
+			vector<unsigned int> rodIndices, pairIndices;
+			for (unsigned int i = 0; i < rods.size(); i++)
+			{
+				bool touches = subtreeComponent != NULL && (inSubtree(rods[i]) || rods[i]->isAncestorOf(subtreeComponent));
+				if (keep(touches))
+					rodIndices.push_back(i);
+			}
+			for (unsigned int i = 0; i < pairs.size(); i++)
+			{
+				bool touches = inSubtree(pairs[i].first) || inSubtree(pairs[i].second);
+				if (keep(touches))
+					pairIndices.push_back(i);
+			}
+
+			// The value mobile has the same shape, so the same indices pick out the same terms
+			pickTerms(mobile, rodIndices, pairIndices, terms);
+			pickTerms(valueMobile, rodIndices, pairIndices, valueTerms);
+		}
+
+		template<typename RealNum>
+		void MobileFactorTemplate::TermsFactor::pickTerms(const Mobile<RealNum, Dim>& m,
+			const vector<unsigned int>& rodIndices, const vector<unsigned int>& pairIndices, Terms<RealNum>& t)
+		{
+			const auto& rods = m.rods();
+			const auto& pairs = m.collisionPairs();
+			for (auto i : rodIndices)
+				t.rods.push_back(rods[i]);
+			for (auto i : pairIndices)
+				t.pairs.push_back(pairs[i]);
+		}
+
+		// The mobiles read their symbols' parameters, which FactorModel has already set
+		var MobileFactorTemplate::TermsFactor::log_prob(const ParameterVector<var>& params)
+		{
+			return evaluate(mobile, terms);
+		}
+
+		double MobileFactorTemplate::TermsFactor::log_prob(const ParameterVector<double>& params)
+		{
+			return evaluate(valueMobile, valueTerms);
+		}
+
+		template<typename RealNum>
+		RealNum MobileFactorTemplate::TermsFactor::evaluate(Mobile<RealNum, Dim>& mobile, const Terms<RealNum>& t)
+		{
+			mobile.updateAnchors();
+
+			RealNum lp = 0.0;
+
+			if (MobileFactorTemplate::Factor::collisionsEnabled)
+			{
+				for (const auto& p : t.pairs)
+					lp += NormalDistribution<RealNum, double>::LogProb(p.collision(), 0.0, CollisionSD[p.type] * MobileFactorTemplate::Factor::collisionScaleFactor);
+			}
+
+			if (MobileFactorTemplate::Factor::torqueEnabled)
+			{
+				double torqueSD = TorqueSD * MobileFactorTemplate::Factor::torqueScaleFactor;
+				for (auto rod : t.rods)
+					lp += NormalDistribution<RealNum, double>::LogProb(rod->torqueNorm(), 0.0, torqueSD);
 			}
 
 			return lp;
@@ -59,5 +257,7 @@ namespace simference
 		double MobileFactorTemplate::Factor::collisionScaleFactor = 0.33;
 		bool MobileFactorTemplate::Factor::torqueEnabled = true;
 		double MobileFactorTemplate::Factor::torqueScaleFactor = 0.25; // 0.001?
+		bool MobileFactorTemplate::Factor::broadPhaseEnabled = true;
+		bool MobileFactorTemplate::Factor::segmentedGradient = false;
 	}
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "../Common/Model.h"
 #include "Mobile.h"
+#include "CompiledMobile.h"
 
 namespace simference
 {
@@ -11,25 +12,103 @@ namespace simference
 		class MobileFactorTemplate : public FactorTemplate
 		{
 		public:
-			MobileFactorTemplate(const Eigen::Vector3d& a) : anchor(a) {}
+			// With 'decompose' set, the mobile is scored as a sum of independent per-rod torque terms and
+			// per-pair collision terms (TermsFactor), rather than one Gaussian per collision total plus one on
+			// the soft-max torque (Factor). Only the decomposed form lets a LARJ jump share the terms that
+			// don't touch the rerolled subtree.
+			MobileFactorTemplate(const Eigen::Vector3d& a, bool decompose = false) : anchor(a), decomposed(decompose) {}
 			void unroll(StructurePtr s, std::vector<FactorPtr>& factors) const;
+			void unroll(StructurePtr sOld, StructurePtr sNew,
+				std::vector<FactorPtr>& fOld, std::vector<FactorPtr>& fNew, std::vector<FactorPtr>& fShared) const;
+
+			// The factors work on planar mobiles (see Mobile)
+			static const int Dim = 2;
 
 			class Factor : public simference::Models::Factor
 			{
 			public:
 				Factor(StructurePtr s, const Eigen::Vector3d& anchor);
 				stan::agrad::var log_prob(const ParameterVector<stan::agrad::var>& params);
+				double log_prob(const ParameterVector<double>& params);
+				AD::Recorded log_prob(const ParameterVector<AD::Recorded>& params);
+				bool readsStructureParams() const { return false; }
+				bool recordable() const { return true; }
 
 				static bool collisionsEnabled;
 				static double collisionScaleFactor;
 				static bool torqueEnabled;
 				static double torqueScaleFactor;
+				static bool broadPhaseEnabled;
+				// With 'segmentedGradient' set, the factor's gradient is computed in double, a block of terms at a
+				// time (see CompiledMobile::Adjoints), and the factor goes on the tape as a single node. Its tape
+				// memory then no longer grows with the number of collision pairs.
+				static bool segmentedGradient;
+
+			private:
+				// Compiled forms of the structure's mobile, which read the parameters directly
+				CompiledMobile<stan::agrad::var> mobile;
+				CompiledMobile<double> valueMobile;
+				CompiledMobile<AD::Recorded> recordedMobile;
+
+				// The factor and its gradient (w.r.t. every parameter), for segmentedGradient
+				double valueAndGradient(const ParameterVector<double>& params, double* gradient);
+				class SegmentedKernel : public AD::Kernel
+				{
+				public:
+					double evaluate(unsigned int n, const double* inputs, double* partials) const
+					{ return factor->valueAndGradient(ParameterVector<double>(inputs, n), partials); }
+					Factor* factor;
+				};
+				SegmentedKernel segmentedKernel;
+				CompiledMobile<double>::Adjoints adjoints;
+				std::vector<double> values, gradient;
+
+				template<typename RealNum> static RealNum evaluate(CompiledMobile<RealNum>& m, const ParameterVector<RealNum>& params,
+					bool broadPhase = broadPhaseEnabled);
+			};
+
+			// Per-rod torque terms and per-pair collision terms. Uses the enable flags and
+			// scale factors of Factor.
+			class TermsFactor : public simference::Models::Factor
+			{
+			public:
+				// Which of the mobile's terms to include, relative to a rerolled subtree. A term 'touches' the subtree
+				// if it depends on any parameter inside it: collisions involving a component of the subtree, and the
+				// torques of rods in the subtree or above it (which carry its mass).
+				enum Selection
+				{
+					AllTerms = 0,
+					TermsTouchingSubtree,
+					TermsNotTouchingSubtree
+				};
+
+				TermsFactor(StructurePtr s, const Eigen::Vector3d& anchor,
+					simference::Grammar::SymbolPtr<stan::agrad::var>::type subtreeRoot = NULL, Selection sel = AllTerms);
+				stan::agrad::var log_prob(const ParameterVector<stan::agrad::var>& params);
+				double log_prob(const ParameterVector<double>& params);
 
 			private:
-				Mobile<stan::agrad::var> mobile;
+				template<typename RealNum>
+				class Terms
+				{
+				public:
+					std::vector<typename Mobile<RealNum, Dim>::RodComponent*> rods;
+					std::vector<typename Mobile<RealNum, Dim>::CollisionPair> pairs;
+				};
+
+				Mobile<stan::agrad::var, Dim> mobile;
+				Mobile<double, Dim> valueMobile;
+				Terms<stan::agrad::var> terms;
+				Terms<double> valueTerms;
+
+				template<typename RealNum> static void pickTerms(const Mobile<RealNum, Dim>& m,
+					const std::vector<unsigned int>& rodIndices, const std::vector<unsigned int>& pairIndices, Terms<RealNum>& t);
+				template<typename RealNum> static RealNum evaluate(Mobile<RealNum, Dim>& m, const Terms<RealNum>& t);
 			};
+
 		private:
 			Eigen::Vector3d anchor;
+			bool decomposed;
 		};
 	}
 }
@@ -3,8 +3,10 @@
 #include "MobileGrammar.h"
 #include "Mobile.h"
 #include "MobileModel.h"
+#include "CompiledMobile.h"
 #include <iostream>
 #include <chrono>
+#include <map>
 #include <random>
 #include <fstream>
 #include <GL/glut.h>
@@ -22,13 +24,89 @@ typedef var RealNum;
 // I have to use pointers for everything because
 // agrad::var cannot be statically allocated safely.
 String<RealNum>::type* axiom = NULL;
+StringTerminal<RealNum>* axiomRoot = NULL;
+static const double axiomStringLength = 2.0;
 shared_ptr<DerivationTree<RealNum>> derivationTree = shared_ptr<DerivationTree<RealNum>>(NULL);
+vector<double> derivationParams;	// Plain values of derivationTree's parameters (see reseatParameters)
 Mobile<RealNum>* mobile = NULL;
 Vector3d anchor(0.0, 9.5, 0.0);
 
+// Whether the LARJ runs ('l', 'v') unroll decomposed mobile factors, which share
+// collision/torque terms between the two models of a jump (toggle with 'm').
+// Off by default: the decomposed factor is a different density (per-pair and per-rod
+// kernels, rather than the per-type totals the bandwidths were calibrated for).
+bool decomposeMobileFactor = false;
+
 vector<Sample> mostRecentSamples;
 int currSampleIndex = 0;
 
+// Rewinding the tape (see AD::EvaluationScope) frees every var, including the ones held by the axiom
+// and by the displayed derivation and its mobile. These give them fresh ones from their plain values.
+void reseatAxiom()
+{
+	axiomRoot->params[StringLength] = axiomStringLength;
+}
+
+void reseatParameters()
+{
+	reseatAxiom();
+	if (derivationTree)
+	{
+		vector<var> params(derivationParams.begin(), derivationParams.end());
+		derivationTree->setParams(params);
+		mobile->updateAnchors();
+	}
+}
+
+// Displays a derivation with the given parameter values
+void showDerivation(shared_ptr<DerivationTree<RealNum>> dt, const vector<double>& params)
+{
+	derivationTree = dt;
+	derivationParams = params;
+	vector<var> p(params.begin(), params.end());
+	derivationTree->setParams(p);
+	if (mobile) delete mobile;
+	mobile = new Mobile<RealNum>(derivationTree->derivation, anchor);
+}
+
+// Evaluates the gradients of random structures' models two ways (switched by 'useAlternative'), and
+// prints the largest relative difference in the log prob or any partial, for several maximum depths
+void compareGradients(const FactorTemplateModel& ftm, const function<void(bool)>& useAlternative)
+{
+	static const unsigned int maxDepths[4] = { 3, 5, 7, 9 };
+	static const unsigned int nStructuresPerDepth = 50;
+
+	auto relativeDifference = [](double a, double b) { return abs(a - b) / max(1.0, abs(a)); };
+	unsigned int originalMaxDepth = MobileGrammar::Parameters<RealNum>::Instance()->maxDepth;
+	cout << "Max Depth | Samples | Worst Relative Difference" << endl;
+	for (auto maxDepth : maxDepths)
+	{
+		MobileGrammar::Parameters<RealNum>::Instance()->maxDepth = maxDepth;
+		double worst = 0.0;
+		for (unsigned int i = 0; i < nStructuresPerDepth; i++)
+		{
+			AD::EvaluationScope scope;
+			reseatAxiom();
+			auto dtree = shared_ptr<DerivationTree<RealNum>>(new DerivationTree<RealNum>(*axiom));
+			vector<var> p; dtree->getParams(p);
+			vector<double> params; for (auto d : p) params.push_back(d.val());
+			ModelPtr model = ftm.unroll(dtree);
+
+			vector<int> params_i;
+			vector<double> grad, altGrad;
+			useAlternative(false);
+			double lp = model->grad_log_prob(params, params_i, grad);
+			useAlternative(true);
+			double altLp = model->grad_log_prob(params, params_i, altGrad);
+			worst = max(worst, relativeDifference(lp, altLp));
+			for (unsigned int j = 0; j < grad.size(); j++)
+				worst = max(worst, relativeDifference(grad[j], altGrad[j]));
+		}
+		cout << maxDepth << " | " << nStructuresPerDepth << " | " << worst << endl;
+	}
+	MobileGrammar::Parameters<RealNum>::Instance()->maxDepth = originalMaxDepth;
+}
+
 void reshape(int w, int h)
 {
 	glViewport(0, 0, w, h);
@@ -55,9 +133,10 @@ void keyboard(unsigned char key, int x, int y)
 
 	if (key == 's')
 	{
-		derivationTree = shared_ptr<DerivationTree<RealNum>>(new DerivationTree<RealNum>(*axiom));
-		if (mobile) delete mobile;
-		mobile = new Mobile<RealNum>(derivationTree->derivation, anchor);
+		auto dt = shared_ptr<DerivationTree<RealNum>>(new DerivationTree<RealNum>(*axiom));
+		vector<var> p; dt->getParams(p);
+		vector<double> params; for (auto d : p) params.push_back(d.val());
+		showDerivation(dt, params);
 		needsRedisplay = true;
 	}
 	else if (key == 'p')
@@ -125,6 +204,126 @@ void keyboard(unsigned char key, int x, int y)
 		summ.print();
 		cout << "torque: " << torque / nCollisionSamples << endl;
 	}
+	else if (key == 'b')
+	{
+		// Benchmark static collision checking against component count, for the component tree
+		// and for the compiled mobile without/with the broad phase
+		static const unsigned int maxDepths[4] = { 3, 5, 7, 9 };
+		static const unsigned int nStructuresPerDepth = 100;
+		static const unsigned int nRepeats = 20;
+		static const unsigned int bucketSize = 20;
+
+		typedef chrono::high_resolution_clock Clock;
+		auto microseconds = [](Clock::time_point t0, Clock::time_point t1)
+		{
+			return chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count() / (1000.0 * nRepeats);
+		};
+
+		map<unsigned int, unsigned int> counts;
+		map<unsigned int, double> treeTimes, compiledTimes, broadPhaseTimes;
+		unsigned int numMismatches = 0, numGradientMismatches = 0;
+		unsigned int originalMaxDepth = MobileGrammar::Parameters<RealNum>::Instance()->maxDepth;
+		for (auto maxDepth : maxDepths)
+		{
+			MobileGrammar::Parameters<RealNum>::Instance()->maxDepth = maxDepth;
+			for (unsigned int i = 0; i < nStructuresPerDepth; i++)
+			{
+				// Sampling the structure puts its parameters on the tape; rewind it per structure
+				AD::EvaluationScope scope;
+				reseatAxiom();
+				DerivationTree<RealNum> dtree(*axiom);
+				vector<var> p; dtree.getParams(p);
+				vector<double> params; for (auto d : p) params.push_back(d.val());
+
+				// Both sides are timed on doubles: the tree mobile is built on the value twin, as TermsFactor does
+				auto vtree = dtree.valueTree();
+				vtree->setParams(ParameterVector<double>(params));
+				Mobile<double> m(vtree->derivation, anchor);
+				CompiledMobile<double> cm(dtree.derivation, anchor);
+				cm.update(ParameterVector<double>(params));
+
+				auto t0 = Clock::now();
+				for (unsigned int r = 0; r < nRepeats; r++) m.checkStaticCollisions();
+				auto t1 = Clock::now();
+				for (unsigned int r = 0; r < nRepeats; r++) cm.checkStaticCollisions(false);
+				auto t2 = Clock::now();
+				for (unsigned int r = 0; r < nRepeats; r++) cm.checkStaticCollisions(true);
+				auto t3 = Clock::now();
+
+				auto full = cm.checkStaticCollisions(false);
+				auto pruned = cm.checkStaticCollisions(true);
+				if (full.rodXrod != pruned.rodXrod || full.rodXstring != pruned.rodXstring || full.rodXweight != pruned.rodXweight ||
+					full.weightXstring != pruned.weightXstring || full.weightXweight != pruned.weightXweight)
+					numMismatches++;
+
+				// Nor may it change their gradients
+				CompiledMobile<var> vcm(dtree.derivation, anchor);
+				auto collisionGradient = [&](bool broadPhase, vector<double>& g)
+				{
+					stan::agrad::set_zero_all_adjoints();
+					vector<var> pv(params.begin(), params.end());
+					vcm.update(ParameterVector<var>(pv));
+					auto c = vcm.checkStaticCollisions(broadPhase);
+					var total = c.rodXrod + c.rodXstring + c.rodXweight + c.weightXstring + c.weightXweight;
+					stan::agrad::grad(total.vi_);
+					for (auto& v : pv) g.push_back(v.adj());
+				};
+				vector<double> fullGrad, prunedGrad;
+				collisionGradient(false, fullGrad);
+				collisionGradient(true, prunedGrad);
+				for (unsigned int j = 0; j < fullGrad.size(); j++)
+				{
+					if (abs(fullGrad[j] - prunedGrad[j]) > 1e-10 * max(1.0, abs(fullGrad[j])))
+					{
+						numGradientMismatches++;
+						break;
+					}
+				}
+
+				unsigned int bucket = (cm.numStrings() + cm.numRods() + cm.numWeights()) / bucketSize;
+				counts[bucket]++;
+				treeTimes[bucket] += microseconds(t0, t1);
+				compiledTimes[bucket] += microseconds(t1, t2);
+				broadPhaseTimes[bucket] += microseconds(t2, t3);
+			}
+		}
+		MobileGrammar::Parameters<RealNum>::Instance()->maxDepth = originalMaxDepth;
+
+		cout << "Collision check cost (microseconds per call):" << endl;
+		cout << "Components | Samples | Tree | Compiled | Compiled + Broad Phase" << endl;
+		for (auto& c : counts)
+		{
+			unsigned int b = c.first;
+			cout << b*bucketSize << "-" << (b+1)*bucketSize-1 << " | " << c.second << " | " << treeTimes[b]/c.second << " | "
+				<< compiledTimes[b]/c.second << " | " << broadPhaseTimes[b]/c.second << endl;
+		}
+		cout << "Broad phase mismatches: " << numMismatches << endl;
+		cout << "Broad phase gradient mismatches: " << numGradientMismatches << endl;
+	}
+	else if (key == 'g')
+	{
+		// Check the mobile factor's segmented gradient against stan's
+		FactorTemplateModel ftm;
+		ftm.addTemplate(FactorTemplatePtr(new MobileFactorTemplate(anchor)));
+		bool originalSegmented = MobileFactorTemplate::Factor::segmentedGradient;
+		bool originalReplay = FactorModel::replayEnabled;
+		FactorModel::replayEnabled = false;
+		cout << "Segmented vs. stan gradient:" << endl;
+		compareGradients(ftm, [](bool segmented) { MobileFactorTemplate::Factor::segmentedGradient = segmented; });
+		MobileFactorTemplate::Factor::segmentedGradient = originalSegmented;
+		FactorModel::replayEnabled = originalReplay;
+	}
+	else if (key == 'r')
+	{
+		// Check replayed gradients against stan's, on the same models and parameters
+		FactorTemplateModel ftm;
+		ftm.addTemplate(FactorTemplatePtr(new GrammarFactorTemplate));
+		ftm.addTemplate(FactorTemplatePtr(new MobileFactorTemplate(anchor)));
+		bool originalReplay = FactorModel::replayEnabled;
+		cout << "Replayed vs. stan gradient:" << endl;
+		compareGradients(ftm, [](bool replay) { FactorModel::replayEnabled = replay; });
+		FactorModel::replayEnabled = originalReplay;
+	}
 	else if (key == 'h')
 	{
 		// Use stan's hmc to sample a bunch of parameter settings
@@ -153,10 +352,7 @@ void keyboard(unsigned char key, int x, int y)
 		//unsigned seed = chrono::system_clock::now().time_since_epoch().count();
 		//shuffle(samples.begin(), samples.end(), default_random_engine(seed));
 		const Sample& bestsamp = samples[0];
-		params.clear();
-		for (double d : bestsamp.params) params.push_back(var(d));
-		derivationTree->setParams(params);
-		mobile->updateAnchors();
+		showDerivation(derivationTree, bestsamp.params);
 		needsRedisplay = true;
 	}
 	else if (key == 'j')
@@ -179,11 +375,14 @@ void keyboard(unsigned char key, int x, int y)
 		StructurePtr newstruct = gs.jumpProposalTest(p2, matching);
 
 		// Visualize the result
-		derivationTree = static_pointer_cast<DerivationTree<RealNum>>(newstruct);
-		if (mobile) delete mobile;
-		mobile = new Mobile<RealNum>(derivationTree->derivation, anchor);
+		showDerivation(static_pointer_cast<DerivationTree<RealNum>>(newstruct), matching.translateExtendedToNew(p2));
 		needsRedisplay = true;
 	}
+	else if (key == 'm')
+	{
+		decomposeMobileFactor = !decomposeMobileFactor;
+		cout << "Decomposed mobile factors: " << decomposeMobileFactor << endl;
+	}
 	else if (key == 'l')
 	{
 		static const unsigned int numLARJiters = 400/*1000*/;	// RESET this to 1000
@@ -195,7 +394,7 @@ void keyboard(unsigned char key, int x, int y)
 		vector<double> p; for (auto var : params) p.push_back(var.val());
 		FactorTemplateModelPtr ftmp = FactorTemplateModelPtr(new FactorTemplateModel);
 		ftmp->addTemplate(FactorTemplatePtr(new GrammarFactorTemplate));
-		ftmp->addTemplate(FactorTemplatePtr(new MobileFactorTemplate(anchor)));
+		ftmp->addTemplate(FactorTemplatePtr(new MobileFactorTemplate(anchor, decomposeMobileFactor)));
 		GrammarJumpSampler gs(ftmp, derivationTree, p, numLARJannealSteps, jumpFreq);
 
 		mostRecentSamples.clear();
@@ -214,7 +413,7 @@ void keyboard(unsigned char key, int x, int y)
 
 		FactorTemplateModelPtr ftmp = FactorTemplateModelPtr(new FactorTemplateModel);
 		ftmp->addTemplate(FactorTemplatePtr(new GrammarFactorTemplate));
-		ftmp->addTemplate(FactorTemplatePtr(new MobileFactorTemplate(anchor)));
+		ftmp->addTemplate(FactorTemplatePtr(new MobileFactorTemplate(anchor, decomposeMobileFactor)));
 		vector<var> params; derivationTree->getParams(params);
 		vector<double> p; for (auto var : params) p.push_back(var.val());
 
@@ -261,6 +460,9 @@ void keyboard(unsigned char key, int x, int y)
 							MobileFactorTemplate::Factor::collisionScaleFactor = originalCollisionScale*scaleMult;
 							MobileFactorTemplate::Factor::torqueScaleFactor = originalTorqueScale*scaleMult;
 
+							// Models unrolled under the old settings (and their recorded gradients) no longer apply
+							ftmp->clearCache();
+
 							// Set up and run sampler
 							GrammarJumpSampler gs(ftmp, derivationTree, p, nAnneal, jumpFrequency);
 							vector<Sample> samples;
@@ -270,7 +472,8 @@ void keyboard(unsigned char key, int x, int y)
 								JumpSampler::sample(gs, samples, numIterations);
 
 							// Report
-							cout << "Adapt=" << adaptType << ", Scale=" << scaleMult << ", AnnealSteps=" << nAnneal << ", Collisions=" << collOn << ", Torque=" << torqueOn << endl;
+							cout << "Adapt=" << adaptType << ", Scale=" << scaleMult << ", AnnealSteps=" << nAnneal << ", Collisions=" << collOn << ", Torque=" << torqueOn
+								<< ", Decomposed=" << decomposeMobileFactor << endl;
 							gs.writeAnalytics(cout);
 							ofstream log("log.csv", std::ios_base::app);
 							log << adaptType << "," << scaleMult << "," << nAnneal << "," << collOn << "," << torqueOn << ","
@@ -297,6 +500,9 @@ void keyboard(unsigned char key, int x, int y)
 		}
 	}
 
+	// The command may have rewound the tape
+	reseatParameters();
+
 	if (needsRedisplay)
 		glutPostRedisplay();
 }
@@ -308,12 +514,7 @@ void special(int key, int x, int y)
 	auto displayCurrentSample = [&needsRedisplay] ()
 	{
 		const Sample& samp = mostRecentSamples[currSampleIndex];
-		derivationTree = static_pointer_cast<DerivationTree<var>>(samp.structure);
-		vector<var> params;
-		for (double d : samp.params) params.push_back(d);
-		derivationTree->setParams(params);
-		delete mobile;
-		mobile = new Mobile<var>(derivationTree->derivation, anchor);
+		showDerivation(static_pointer_cast<DerivationTree<var>>(samp.structure), samp.params);
 		needsRedisplay = true;
 		cout << "(" << currSampleIndex << ") ";
 		samp.print(cout);
@@ -354,9 +555,9 @@ int main(int argc, char** argv)
 	axiom = new String<RealNum>::type;
 
 	// We start with a single string (the string from which everything hangs)
-	auto root = new StringTerminal<RealNum>(0, 0);
-	root->params[StringLength] = 2.0;
-	axiom->push_back(SymbolPtr<RealNum>::type(root));
+	axiomRoot = new StringTerminal<RealNum>(0, 0);
+	reseatAxiom();
+	axiom->push_back(SymbolPtr<RealNum>::type(axiomRoot));
 	axiom->push_back(SymbolPtr<RealNum>::type(new StringEndpointVariable<RealNum>(0)));
 
 	glutMainLoop();
@@ -37,8 +37,9 @@ namespace simference
 		bool operator < (const BCAD& other) const
 		{
 			// Compare the first other.length bits of this.code
-			// with other.code
-			return other.code == (this->code >> (length - other.length));
+			// with other.code (a shorter code can't descend from a longer one,
+			// and shifting by the negative difference would be undefined)
+			return length >= other.length && other.code == (this->code >> (length - other.length));
 		}
 
 		void print() const
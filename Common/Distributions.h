@@ -12,6 +12,25 @@ namespace simference
 	{
 		namespace Probability
 		{
+			// A distribution over the reals reduced to plain data: its log density is
+			// logNormalizer - ((x - mean)/sd)^2 / 2 on (lo, hi) (without the quadratic term for Uniform),
+			// and -infinity elsewhere. Opaque distributions can only be evaluated through their own methods.
+			class FlatDistribution
+			{
+			public:
+				enum Kind { Opaque = 0, Uniform, Normal, TruncatedNormal };
+				FlatDistribution(Kind k = Opaque, double mu = 0.0, double sigma = 1.0,
+					double l = -std::numeric_limits<double>::infinity(), double h = std::numeric_limits<double>::infinity(),
+					double logZ = 0.0)
+					: kind(k), mean(mu), sd(sigma), lo(l), hi(h), logNormalizer(logZ) {}
+				Kind kind;
+				double mean, sd, lo, hi, logNormalizer;
+			};
+
+			// Distribution parameters as plain doubles (they may be AD variables, but are constants in practice)
+			inline double flatParam(double x) { return x; }
+			template<typename T> double flatParam(const T& x) { return x.val(); }
+
 			template<typename ProbType, typename ValType = ProbType>
 			class Distribution
 			{
@@ -21,12 +40,18 @@ namespace simference
 				virtual ProbType logprob(ValType val) const { return (ProbType)log(prob(val)); }
 
 				virtual ValType sample() const = 0;
+
+				virtual FlatDistribution flatten() const { return FlatDistribution(); }
+
+				// The same distribution over another scalar type
+				template<typename T> struct Rebind { typedef Distribution<T, T> type; };
 			};
 
 			template<typename ValProbType, typename ParamType = ValProbType>
-			class UniformDistribution : public Distribution<ValProbType, ValProbType>
+			class UniformDistribution final : public Distribution<ValProbType, ValProbType>
 			{
 			public:
+				template<typename T> struct Rebind { typedef UniformDistribution<T, ParamType> type; };
 				UniformDistribution(ParamType minv = (ParamType)0.0, ParamType maxv = (ParamType)1.0)
 					: minval(minv), maxval(maxv) {}
 				static ValProbType Prob(ValProbType val, ParamType minvalue, ParamType maxvalue)
@@ -49,6 +74,11 @@ namespace simference
 				ValProbType prob(ValProbType val) const { return Prob(val, minval, maxval); }
 				ValProbType logprob(ValProbType val) const { return LogProb(val, minval, maxval); }
 				ValProbType sample() const { return Sample(minval, maxval); }
+				FlatDistribution flatten() const
+				{
+					double lo = flatParam(minval), hi = flatParam(maxval);
+					return FlatDistribution(FlatDistribution::Uniform, 0.0, 1.0, lo, hi, -log(hi - lo));
+				}
 
 			private:
 				ParamType minval, maxval;
@@ -81,9 +111,10 @@ namespace simference
 			};
 
 			template<typename ValProbType, typename ParamType = ValProbType>
-			class NormalDistribution : public Distribution<ValProbType, ValProbType>
+			class NormalDistribution final : public Distribution<ValProbType, ValProbType>
 			{
 			public:
+				template<typename T> struct Rebind { typedef NormalDistribution<T, ParamType> type; };
 				NormalDistribution(ParamType mu = (ParamType)0.0, ParamType sigma = (ParamType)1.0)
 					: mean(mu), stddev(sigma) {}
 				static ValProbType LogProb(ValProbType val, ParamType mu, ParamType sigma)
@@ -111,6 +142,13 @@ namespace simference
 				ValProbType prob(ValProbType val) const { return Prob(val, mean, stddev); }
 				ValProbType logprob(ValProbType val) const { return LogProb(val, mean, stddev); }
 				ValProbType sample() const { return Sample(mean, stddev); }
+				FlatDistribution flatten() const
+				{
+					double sigma = flatParam(stddev);
+					return FlatDistribution(FlatDistribution::Normal, flatParam(mean), sigma,
+						-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
+						log(1.0/(sigma*sqrt(TwoPi))));
+				}
 			private:
 				ParamType mean, stddev;
 			};
@@ -147,11 +185,27 @@ namespace simference
 			}
 
 			template<typename ValProbType, typename ParamType = ValProbType>
-			class TruncatedNormalDistribution : public Distribution<ValProbType, ValProbType>
+			class TruncatedNormalDistribution final : public Distribution<ValProbType, ValProbType>
 			{
 			public:
+				template<typename T> struct Rebind { typedef TruncatedNormalDistribution<T, ParamType> type; };
 				TruncatedNormalDistribution(ParamType mu, ParamType sigma, ParamType lo, ParamType hi)
-					: mean(mu), stddev(sigma), lowerBound(lo), upperBound(hi) {}
+					: mean(mu), stddev(sigma), lowerBound(lo), upperBound(hi),
+					logNormalizer(LogNormalizer(mu, sigma, lo, hi)) {}
+				// Log of the density's constant factor: the normal's, divided by the mass inside the bounds
+				static ParamType LogNormalizer(ParamType mu, ParamType sigma, ParamType lo, ParamType hi)
+				{
+					return log(1.0/(sigma*sqrt(TwoPi))) - log(cumulativeNormal((hi-mu)/sigma) - cumulativeNormal((lo-mu)/sigma));
+				}
+				static ValProbType LogProb(ValProbType val, ParamType mu, ParamType sigma, ParamType lo, ParamType hi)
+				{
+					if (val > lo && val < hi)
+					{
+						ValProbType valMinusMu = val - mu;
+						return LogNormalizer(mu, sigma, lo, hi) - valMinusMu*valMinusMu/(2*sigma*sigma);
+					}
+					else return -std::numeric_limits<ValProbType>::infinity();
+				}
 				static ValProbType Prob(ValProbType val, ParamType mu, ParamType sigma, ParamType lo, ParamType hi)
 				{
 					if (val > lo && val < hi)
@@ -170,9 +224,24 @@ namespace simference
 					return sigma*raw + mu;
 				}
 				ValProbType prob(ValProbType val) const { return Prob(val, mean, stddev, lowerBound, upperBound); }
+				ValProbType logprob(ValProbType val) const
+				{
+					if (val > lowerBound && val < upperBound)
+					{
+						ValProbType valMinusMu = val - mean;
+						return logNormalizer - valMinusMu*valMinusMu/(2*stddev*stddev);
+					}
+					else return -std::numeric_limits<ValProbType>::infinity();
+				}
 				ValProbType sample() const { return Sample(mean, stddev, lowerBound, upperBound); }
+				FlatDistribution flatten() const
+				{
+					return FlatDistribution(FlatDistribution::TruncatedNormal, flatParam(mean), flatParam(stddev),
+						flatParam(lowerBound), flatParam(upperBound), flatParam(logNormalizer));
+				}
 			private:
 				ParamType mean, stddev, lowerBound, upperBound;
+				ParamType logNormalizer;
 			};
 		}
 	}
@@ -0,0 +1,52 @@
+#ifndef __EVALUATION_SCOPE_H
+#define __EVALUATION_SCOPE_H
+
+#include <stan/agrad/agrad.hpp>
+#include <algorithm>
+#include <cstddef>
+
+namespace simference
+{
+	namespace AD
+	{
+		// Brackets one use of the stan tape (a model evaluation, a jump proposal...). When the outermost
+		// scope ends, the tape is rewound, so its memory is reused by the next evaluation rather than
+		// growing across them. Stan can only rewind the whole tape, so this frees every var made before
+		// the scope as well as those made inside it: state that outlives an evaluation must hold plain
+		// values, or re-seat its vars from them before reading them again.
+		// Every scope also updates the tape's high-water marks, for sizing runs.
+		class EvaluationScope
+		{
+		public:
+			EvaluationScope() { depth()++; }
+			inline ~EvaluationScope();
+
+			// Largest arena (in bytes) and node count the tape has reached since the last resetPeaks
+			static size_t peakTapeBytes() { return peaks().bytes; }
+			static size_t peakTapeNodes() { return peaks().nodes; }
+			static void resetPeaks() { peaks() = Usage(); }
+
+		private:
+			class Usage
+			{
+			public:
+				Usage() : bytes(0), nodes(0) {}
+				size_t bytes, nodes;
+			};
+
+			static unsigned int& depth() { static unsigned int d = 0; return d; }
+			static Usage& peaks() { static Usage u; return u; }
+		};
+
+		inline EvaluationScope::~EvaluationScope()
+		{
+			Usage& p = peaks();
+			p.bytes = std::max(p.bytes, stan::agrad::memalloc_.bytes_allocated());
+			p.nodes = std::max(p.nodes, stan::agrad::var_stack_.size() + stan::agrad::var_nochain_stack_.size());
+			if (--depth() == 0)
+				stan::agrad::recover_memory();
+		}
+	}
+}
+
+#endif
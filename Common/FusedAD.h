@@ -0,0 +1,106 @@
+#ifndef __FUSED_AD_H
+#define __FUSED_AD_H
+
+#include "Math.h"
+#include <stan/agrad/agrad.hpp>
+#include <algorithm>
+#include <vector>
+
+namespace simference
+{
+	namespace AD
+	{
+		// A single tape node for a function of several vars, whose partial derivatives
+		// were computed (in double) alongside its value. The reverse sweep through it is
+		// one multiply-add per operand.
+		class PrecomputedGradientsVari : public stan::agrad::vari
+		{
+		public:
+			PrecomputedGradientsVari(double value, unsigned int n, const stan::agrad::var* ops, const double* parts)
+				: vari(value), size(n),
+				operands(stan::agrad::memalloc_.alloc_array<stan::agrad::vari*>(n)),
+				partials(stan::agrad::memalloc_.alloc_array<double>(n))
+			{
+				for (unsigned int i = 0; i < n; i++)
+				{
+					operands[i] = ops[i].vi_;
+					partials[i] = parts[i];
+				}
+			}
+
+			void chain()
+			{
+				for (unsigned int i = 0; i < size; i++)
+					operands[i]->adj_ += adj_ * partials[i];
+			}
+
+		private:
+			unsigned int size;
+			stan::agrad::vari** operands;
+			double* partials;
+		};
+
+		inline stan::agrad::var fused(double value, unsigned int n, const stan::agrad::var* operands, const double* partials)
+		{
+			return stan::agrad::var(new PrecomputedGradientsVari(value, n, operands, partials));
+		}
+	}
+
+	namespace Math
+	{
+		// Math::softMax of n doubles, along with its partials w.r.t. them
+		inline double softMax(const double* vals, unsigned int n, double alpha, double* partials)
+		{
+			unsigned int imax = std::max_element(vals, vals + n) - vals;
+			unsigned int imin = std::min_element(vals, vals + n) - vals;
+			double range = vals[imax] - vals[imin];
+
+			// Same computation as the generic version
+			std::vector<double> normnums(n), eans(n);
+			double numer = 0.0;
+			double denom = 0.0;
+			for (unsigned int i = 0; i < n; i++)
+			{
+				normnums[i] = (vals[i] - vals[imin]) / range;
+				eans[i] = exp(alpha*normnums[i]);
+				numer += normnums[i] * eans[i];
+				denom += eans[i];
+			}
+			if (!(denom > 0.0))
+			{
+				std::fill(partials, partials + n, 0.0);
+				return 0.0;
+			}
+			double smax = numer / denom;
+
+			// With weights w_i = eans_i/denom, d(smax)/d(normnum_i) = w_i (1 + alpha (normnum_i - smax)).
+			// The extreme elements also enter through the normalization.
+			double sumPartials = 0.0, sumWeightedPartials = 0.0;
+			for (unsigned int i = 0; i < n; i++)
+			{
+				partials[i] = (eans[i] / denom) * (1.0 + alpha*(normnums[i] - smax));
+				sumPartials += partials[i];
+				sumWeightedPartials += partials[i] * normnums[i];
+			}
+			partials[imin] += 1.0 - smax - sumPartials + sumWeightedPartials;
+			partials[imax] += smax - sumWeightedPartials;
+
+			return vals[imin] + range*smax;
+		}
+
+		// Math::softMax for vars, recorded as one node
+		inline stan::agrad::var softMax(const std::vector<stan::agrad::var>& nums, double alpha)
+		{
+			unsigned int n = nums.size();
+			std::vector<double> vals(n), partials(n);
+			for (unsigned int i = 0; i < n; i++)
+				vals[i] = nums[i].val();
+			double smax = softMax(vals.data(), n, alpha, partials.data());
+			if (std::all_of(partials.begin(), partials.end(), [](double p) { return p == 0.0; }))
+				return smax;
+			return AD::fused(smax, n, &nums[0], &partials[0]);
+		}
+	}
+}
+
+#endif
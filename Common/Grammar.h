@@ -10,6 +10,7 @@
 #include <iostream>
 #include <stack>
 #include <typeinfo>
+#include <cstdint>
 
 using namespace simference::Math::Probability;
 
@@ -17,28 +18,167 @@ namespace simference
 {
 	namespace Grammar
 	{
+		// 64-bit mixing (splitmix64 finalizer) and order-dependent combination for structural hashes
+		inline uint64_t hashMix(uint64_t x)
+		{
+			x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+			x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+			x ^= x >> 31;
+			return x;
+		}
+		inline uint64_t hashCombine(uint64_t seed, uint64_t h)
+		{
+			return hashMix(seed + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+		}
+
+		// Size-bucketed free lists for derivation tree symbols. Trees are copied and thrown away on every
+		// jump proposal, so symbols are recycled from here instead of making a heap round trip each.
+		// Memory is carved out in chunks and kept for the life of the program.
+		class SymbolPool
+		{
+		public:
+			static void* allocate(size_t size)
+			{
+				if (size > MaxSize) return ::operator new(size);
+				Slot*& head = freeList(size);
+				if (head == NULL)
+					refill(head, roundUp(size));
+				Slot* s = head;
+				head = s->next;
+				return s;
+			}
+
+			static void deallocate(void* p, size_t size)
+			{
+				if (size > MaxSize) { ::operator delete(p); return; }
+				Slot*& head = freeList(size);
+				Slot* s = static_cast<Slot*>(p);
+				s->next = head;
+				head = s;
+			}
+
+		private:
+			struct Slot { Slot* next; };
+			enum { Granularity = 16, MaxSize = 512, SlotsPerChunk = 256 };
+
+			static size_t roundUp(size_t size) { return (size + Granularity - 1) / Granularity * Granularity; }
+			static Slot*& freeList(size_t size)
+			{
+				static Slot* heads[MaxSize / Granularity + 1] = { NULL };
+				return heads[roundUp(size) / Granularity];
+			}
+			static void refill(Slot*& head, size_t slotSize)
+			{
+				char* chunk = static_cast<char*>(::operator new(slotSize * SlotsPerChunk));
+				for (unsigned int i = 0; i < SlotsPerChunk; i++)
+				{
+					Slot* s = reinterpret_cast<Slot*>(chunk + i*slotSize);
+					s->next = head;
+					head = s;
+				}
+			}
+		};
+
+		// Kind bits for Symbol::is/as. Every symbol class that can be tested for has its own bit, which its
+		// constructor adds to 'kinds'; grammars number theirs from FirstGrammarKind up.
+		enum SymbolKindBits
+		{
+			TerminalKind = 1 << 0,
+			VariableKind = 1 << 1,
+			FirstGrammarKind = 1 << 2
+		};
+
 		template <typename RealNum>
 		class Symbol
 		{
 		public:
 
-			Symbol(unsigned int d) : depth(d) {}
+			Symbol(unsigned int d) : kinds(0), depth(d), subtreeHash(0), subtreeMirrorHash(0),
+				subtreeLeaves(1), subtreeParams(0), subtreeStructureLogProb(0.0) {}
+			virtual ~Symbol() {}
+			// (The destructor is virtual so that these always see the size of the most derived type)
+			static void* operator new(size_t size) { return SymbolPool::allocate(size); }
+			static void operator delete(void* p, size_t size) { SymbolPool::deallocate(p, size); }
 			virtual void print(std::ostream& outstream) const = 0;
 			virtual void unroll() = 0;
 			virtual RealNum logProb() const = 0;
+			// Log probability of the structural choice this symbol made. It doesn't depend on the
+			// parameters, so it's computed in double (and summed over subtrees by updateStructuralHash).
+			virtual double localStructureLogProb() const { return 0.0; }
 			virtual RealNum recursiveParamLogProb() const = 0;
-			virtual RealNum recursiveStructureLogProb() const = 0;
+			virtual RealNum recursiveStructureLogProb() const { return subtreeStructureLogProb; }
 			virtual RealNum recursiveLogProb() const { return recursiveParamLogProb() + recursiveStructureLogProb(); }
 			virtual unsigned int numParams() const { return 0; }
 			virtual void getParams(std::vector<RealNum>& p) const {}
-			virtual void setParams(const ParameterVector<RealNum>& p, unsigned int& pindex) {}
+			// Where the symbol keeps its numParams() parameters (see DerivationTree::setParams)
+			virtual RealNum* paramStorage() { return NULL; }
+			// Prior on the i'th parameter
+			virtual const Distribution<RealNum>* paramDistribution(unsigned int i) const { return NULL; }
 			virtual unsigned int numChildren() const { return 0; }
 			virtual const std::vector< std::shared_ptr<Symbol<RealNum>> >& children() const = 0;
 			virtual std::shared_ptr<Symbol<RealNum>> deepCopy() const = 0;
-			template<class T> bool is() { return dynamic_cast<T*>(this) != NULL; }
-			template<class T> T* as() { return dynamic_cast<T*>(this); }
+			// Copies this symbol alone; the copy shares its children with the original
+			virtual std::shared_ptr<Symbol<RealNum>> shallowCopy() const = 0;
+			// Copies this subtree into its double-valued twin (see DerivationTree::valueTree)
+			virtual std::shared_ptr<Symbol<double>> valueDeepCopy() const = 0;
+			template<class T> bool is() const { return (kinds & T::KindBit) != 0; }
+			template<class T> T* as() { return is<T>() ? static_cast<T*>(this) : NULL; }
+
+			// Structural hashing: a symbol contributes its type (plus whatever structural choice it made),
+			// combined in order with the hashes of its children. Symbols whose children are interchangeable
+			// under a mirror symmetry combine them order-independently for the mirror hash.
+			// This also tallies how many derivation symbols and parameters the subtree accounts for,
+			// and its structure log probability.
+			virtual uint64_t localStructuralHash() const { return hashMix(typeid(*this).hash_code()); }
+			virtual bool mirrorSymmetricChildren() const { return false; }
+			void updateStructuralHash()
+			{
+				uint64_t local = localStructuralHash();
+				uint64_t h = local;
+				uint64_t mh = local;
+				subtreeStructureLogProb = localStructureLogProb();
+				if (numChildren() > 0)
+				{
+					bool mirror = mirrorSymmetricChildren();
+					uint64_t mirrored = 0;
+					subtreeLeaves = subtreeParams = 0;
+					for (const auto& c : children())
+					{
+						h = hashCombine(h, c->subtreeHash);
+						if (mirror) mirrored += hashMix(c->subtreeMirrorHash);
+						else mh = hashCombine(mh, c->subtreeMirrorHash);
+						subtreeLeaves += c->subtreeLeaves;
+						subtreeParams += c->subtreeParams;
+						subtreeStructureLogProb += c->subtreeStructureLogProb;
+					}
+					if (mirror) mh = hashCombine(mh, mirrored);
+				}
+				else
+				{
+					subtreeLeaves = 1;
+					subtreeParams = numParams();
+				}
+				subtreeHash = h;
+				subtreeMirrorHash = mh;
+			}
 
+			// Copies what updateStructuralHash computed
+			template<typename T> void copySubtreeSummaryTo(Symbol<T>* s) const
+			{
+				s->subtreeHash = subtreeHash;
+				s->subtreeMirrorHash = subtreeMirrorHash;
+				s->subtreeLeaves = subtreeLeaves;
+				s->subtreeParams = subtreeParams;
+				s->subtreeStructureLogProb = subtreeStructureLogProb;
+			}
+
+			unsigned int kinds;	// the KindBits of this symbol's classes
 			unsigned int depth;	// in the derivation tree
+			uint64_t subtreeHash;
+			uint64_t subtreeMirrorHash;
+			unsigned int subtreeLeaves;	// symbols of the derivation string spanned by this subtree
+			unsigned int subtreeParams;	// parameters of those symbols
+			double subtreeStructureLogProb;
 		};
 
 		template <typename RealNum>
@@ -59,19 +199,23 @@ namespace simference
 		class Terminal : public Symbol<RealNum>
 		{
 		public:
-			Terminal(unsigned int d) : Symbol(d) {}
-			void unroll() {}
+			enum { KindBit = TerminalKind };
+			Terminal(unsigned int d) : Symbol(d) { this->kinds |= KindBit; }
+			void unroll() { updateStructuralHash(); }
 			RealNum recursiveParamLogProb() const { return logProb(); }
-			RealNum recursiveStructureLogProb() const { return 0.0; }
+			typename SymbolPtr<RealNum>::type shallowCopy() const { return this->deepCopy(); }
 			const typename String<RealNum>::type& children() const { throw "This method should never be called; what's wrong with you!?"; }
 		};
 
-		template<typename RealNum, unsigned int nParams>
+		// Dist is the (common) type of the parameters' prior distributions. Naming a concrete,
+		// final distribution class lets logProb and sampling bind statically.
+		template<typename RealNum, unsigned int nParams, class Dist = Distribution<RealNum>>
 		class GeneralTerminal : public Terminal<RealNum>
 		{
 		public:
+			typedef typename Dist::template Rebind<double>::type ValueDist;
 
-			GeneralTerminal(unsigned int d, Distribution<RealNum>** dis)
+			GeneralTerminal(unsigned int d, Dist* const* dis)
 				: Terminal(d), distribs(dis)
 			{
 				for (unsigned int i = 0; i < nParams; i++)
@@ -96,24 +240,31 @@ namespace simference
 					p.push_back(params[i]);
 			}
 
-			void setParams(const ParameterVector<RealNum>& p, unsigned int& pindex)
-			{
-				for (unsigned int i = 0; i < nParams; i++, pindex++)
-				{
-					params[i] = p[pindex];
-				}
-			}
+			RealNum* paramStorage() { return params; }
+
+			const Distribution<RealNum>* paramDistribution(unsigned int i) const { return distribs[i]; }
 
-			virtual GeneralTerminal<RealNum, nParams>* copy() const = 0;
+			virtual GeneralTerminal<RealNum, nParams, Dist>* copy() const = 0;
+			virtual GeneralTerminal<double, nParams, ValueDist>* valueCopy() const = 0;
 
 			typename SymbolPtr<RealNum>::type deepCopy() const
 			{
 				auto gt = copy();
 				for (unsigned int i = 0; i < nParams; i++)
 					gt->params[i] = params[i];
+				this->copySubtreeSummaryTo(gt);
 				return SymbolPtr<RealNum>::type(gt);
 			}
 
+			std::shared_ptr<Symbol<double>> valueDeepCopy() const
+			{
+				auto gt = valueCopy();
+				for (unsigned int i = 0; i < nParams; i++)
+					gt->params[i] = valueOf(params[i]);
+				this->copySubtreeSummaryTo(gt);
+				return std::shared_ptr<Symbol<double>>(gt);
+			}
+
 			void print(std::ostream& outstream) const
 			{
 				outstream << name() << "(";
@@ -125,7 +276,7 @@ namespace simference
 			virtual char* name() const = 0;
 
 			RealNum params[nParams];
-			Distribution<RealNum>** distribs;
+			Dist* const* distribs;
 		};
 
 
@@ -137,9 +288,23 @@ namespace simference
 		{
 		public:
 
-			Variable(unsigned int d) : Symbol(d) {}
+			enum { KindBit = VariableKind };
+			Variable(unsigned int d) : Symbol(d) { this->kinds |= KindBit; }
 
 			void unroll()
+			{
+				childSyms.clear();
+				expand();
+
+				// Recursively unroll all children
+				for (const auto& child : childSyms)
+					child->unroll();
+				updateStructuralHash();
+			}
+
+			// Picks one of the applicable productions (setting unrolledProduction to its index in the
+			// production list) and appends its right-hand side to childSyms
+			virtual void expand()
 			{
 				// Accumulate the productions that are actually applicable
 				const vector<Production<RealNum>>& prods = productions();
@@ -163,28 +328,51 @@ namespace simference
 					probs[i] /= totalProb;
 
 				// Sample one proportional to its probability and use it to unroll
-				unrolledProduction = MultinomialDistribution<RealNum>::Sample(probs);
-				const Production<RealNum>& prodToUse = prods[applicableProds[unrolledProduction]];
-				childSyms = prodToUse.unrollFunction(*this);
-
-				// Recursively unroll all children
-				for (auto child : childSyms)
-				{
-					child->unroll();
-				}
+				unrolledProduction = applicableProds[MultinomialDistribution<RealNum>::Sample(probs)];
+				childSyms = prods[unrolledProduction].unrollFunction(*this);
 			}
 
+			virtual double productionProbability(unsigned int i) const { return valueOf(productions()[i].probabilityFunction(*this)); }
+
 			virtual Variable<RealNum>* copy() const = 0;
+			virtual Variable<double>* valueCopy() const = 0;
 
 			typename SymbolPtr<RealNum>::type deepCopy() const
 			{
 				auto v = copy();
 				v->unrolledProduction = unrolledProduction;
-				for (auto s : childSyms)
+				v->childSyms.reserve(childSyms.size());
+				for (const auto& s : childSyms)
 					v->childSyms.push_back(s->deepCopy());
+				this->copySubtreeSummaryTo(v);
 				return SymbolPtr<RealNum>::type(v);
 			}
 
+			typename SymbolPtr<RealNum>::type shallowCopy() const
+			{
+				auto v = copy();
+				v->unrolledProduction = unrolledProduction;
+				v->childSyms = childSyms;
+				this->copySubtreeSummaryTo(v);
+				return SymbolPtr<RealNum>::type(v);
+			}
+
+			std::shared_ptr<Symbol<double>> valueDeepCopy() const
+			{
+				auto v = valueCopy();
+				v->unrolledProduction = unrolledProduction;
+				v->childSyms.reserve(childSyms.size());
+				for (const auto& s : childSyms)
+					v->childSyms.push_back(s->valueDeepCopy());
+				this->copySubtreeSummaryTo(v);
+				return std::shared_ptr<Symbol<double>>(v);
+			}
+
+			uint64_t localStructuralHash() const
+			{
+				return hashCombine(Symbol<RealNum>::localStructuralHash(), unrolledProduction);
+			}
+
 			unsigned int numChildren() const
 			{
 				return childSyms.size();
@@ -195,44 +383,93 @@ namespace simference
 				return childSyms;
 			}
 
-			RealNum logProb() const
+			double localStructureLogProb() const
 			{
 				if (childSyms.size() > 0)
-					return log(productions()[unrolledProduction].probabilityFunction(*this));
+					return log(productionProbability(unrolledProduction));
 				else return 0.0;
 			}
 
-			RealNum recursiveStructureLogProb() const
-			{
-				RealNum lp = logProb();
-				for (auto c : childSyms)
-					lp += c->recursiveStructureLogProb();
-				return lp;
-			}
+			RealNum logProb() const { return localStructureLogProb(); }
 
 			RealNum recursiveParamLogProb() const
 			{
 				RealNum lp = 0.0;
-				for (auto c : childSyms)
+				for (const auto& c : childSyms)
 					lp += c->recursiveParamLogProb();
 				return lp;
 			}
 
-			// Overriding recursiveLogProb in this way allows us to use one tree traversal instead of two.
-			RealNum recursiveLogProb()
+			RealNum recursiveLogProb() const
 			{
-				RealNum lp = logProb();
-				for (auto c : childSyms)
-					lp += c->recursiveLogProb();
-				return lp;
+				return this->subtreeStructureLogProb + recursiveParamLogProb();
 			}
 
-			virtual const std::vector<Production<RealNum>>& productions() const = 0;
+			// Variables that don't override expand and productionProbability list their productions here
+			virtual const std::vector<Production<RealNum>>& productions() const
+			{
+				throw "Variable::productions - This variable has no production list!";
+			}
 
 			typename String<RealNum>::type childSyms;
 			unsigned int unrolledProduction;
 		};
 
+		// A variable whose productions are a compile-time table of static members of 'Derived':
+		//    static const unsigned int NumProductions;
+		//    static bool applicable(unsigned int i, const Derived& v);
+		//    static double probability(unsigned int i, const Derived& v);
+		//    static void rightHandSide(unsigned int i, const Derived& v, String<RealNum>::type& syms);
+		// Dispatch on the production index is direct, and choosing a production doesn't allocate.
+		template<typename RealNum, class Derived>
+		class TableVariable : public Variable<RealNum>
+		{
+		public:
+
+			TableVariable(unsigned int d) : Variable(d) {}
+
+			void expand()
+			{
+				const Derived& self = static_cast<const Derived&>(*this);
+
+				// The applicable productions and their probabilities
+				unsigned int applicable[Derived::NumProductions];
+				double probs[Derived::NumProductions];
+				unsigned int n = 0;
+				double totalProb = 0.0;
+				for (unsigned int i = 0; i < Derived::NumProductions; i++)
+				{
+					if (Derived::applicable(i, self))
+					{
+						applicable[n] = i;
+						probs[n] = Derived::probability(i, self);
+						totalProb += probs[n];
+						n++;
+					}
+				}
+				if (n == 0)
+					throw "TableVariable::expand - No production is applicable to this variable!";
+
+				// Sample one proportional to its probability (as MultinomialDistribution::Sample does)
+				double x = UniformDistribution<double>::Sample();
+				double probAccum = 1e-6;
+				unsigned int k = 0;
+				for (; k < n-1; k++)
+				{
+					probAccum += probs[k] / totalProb;
+					if (x <= probAccum) break;
+				}
+
+				this->unrolledProduction = applicable[k];
+				Derived::rightHandSide(this->unrolledProduction, self, this->childSyms);
+			}
+
+			double productionProbability(unsigned int i) const
+			{
+				return Derived::probability(i, static_cast<const Derived&>(*this));
+			}
+		};
+
 		template<typename RealNum>
 		class Production
 		{
@@ -256,59 +493,173 @@ namespace simference
 		{
 		public:
 
+			DerivationTree() : nParams(0) {}
+
 			DerivationTree(const typename String<RealNum>::type& axiom)
 				: roots(axiom)
 			{
-				for (auto sym : roots)
+				for (const auto& sym : roots)
 					sym->unroll();
+				updateStructuralHash();
 				computeDerivation();
 			}
 
 			DerivationTree(const DerivationTree<RealNum>& dt)
 			{
 				provenance = dt.provenance;
-				for (auto r : dt.roots)
+				roots.reserve(dt.roots.size());
+				for (const auto& r : dt.roots)
 					roots.push_back(r->deepCopy());
+				hash = dt.hash;
+				mirrorHash = dt.mirrorHash;
 				computeDerivation();
 
 				// We don't update provenance here...that only happens in LARJ proposals
 			}
 
+			// A copy of 'dt' with one of its variables rerolled. Only the path from a root down to the
+			// variable is copied: every other subtree is shared with 'dt', so this costs the depth of
+			// the variable plus the size of its new subtree. Trees sharing symbols also share their
+			// parameter storage, which is fine as long as parameters are set before they are read.
+			// Provenance records the old and new subtrees and how the derivation changed (but not 'modifiedFrom').
+			DerivationTree(const DerivationTree<RealNum>& dt, const typename SymbolPtr<RealNum>::type& var)
+				: roots(dt.roots)
+			{
+				// Find the path to the variable
+				std::vector<unsigned int> path;
+				if (!findPath(dt.roots, var.get(), path))
+					throw "DerivationTree::DerivationTree - Variable to reroll is not in this tree!";
+
+				// Copy the symbols along it, swapping each copy in for the original in its copied parent.
+				// Everything to the left of the path comes before the variable in the derivation.
+				Splice& symSplice = provenance.derivationSplice;
+				Splice& paramSplice = provenance.paramSplice;
+				typename String<RealNum>::type* children = &roots;
+				Symbol<RealNum>* parent = NULL;
+				std::vector<Symbol<RealNum>*> copiedPath;
+				for (unsigned int i = 0; i < path.size(); i++)
+				{
+					for (unsigned int j = 0; j < path[i]; j++)
+					{
+						symSplice.offset += (*children)[j]->subtreeLeaves;
+						paramSplice.offset += (*children)[j]->subtreeParams;
+					}
+					typename SymbolPtr<RealNum>::type& slot = (*children)[path[i]];
+					slot = slot->shallowCopy();
+					parent = slot.get();
+					copiedPath.push_back(parent);
+					if (i+1 < path.size())
+						children = &static_cast<Variable<RealNum>*>(parent)->childSyms;
+				}
+
+				// The last copy is the variable itself: give it a brand new subtree
+				auto newVar = static_cast<Variable<RealNum>*>(copiedPath.back());
+				newVar->childSyms.clear();
+				newVar->unroll();
+				provenance.oldSubtreeRoot = var;
+				provenance.newSubtreeRoot = (*children)[path.back()];
+				symSplice.removed = var->subtreeLeaves;
+				symSplice.inserted = newVar->subtreeLeaves;
+				paramSplice.removed = var->subtreeParams;
+				paramSplice.inserted = newVar->subtreeParams;
+
+				// Refresh the hashes of its ancestors (deepest first)
+				for (int i = (int)copiedPath.size()-2; i >= 0; i--)
+					copiedPath[i]->updateStructuralHash();
+				updateStructuralHash();
+
+				// Splice the new subtree's symbols into the old derivation
+				derivation.reserve(dt.derivation.size() - symSplice.removed + symSplice.inserted);
+				derivation.insert(derivation.end(), dt.derivation.begin(), dt.derivation.begin() + symSplice.offset);
+				appendLeaves(typename String<RealNum>::type(1, provenance.newSubtreeRoot), derivation);
+				derivation.insert(derivation.end(), dt.derivation.begin() + symSplice.offset + symSplice.removed, dt.derivation.end());
+				nParams = dt.nParams - paramSplice.removed + paramSplice.inserted;
+
+				// Likewise for the parameter slots (the symbols outside the new subtree are shared, so their slots are too)
+				paramSlots.reserve(nParams);
+				paramSlots.insert(paramSlots.end(), dt.paramSlots.begin(), dt.paramSlots.begin() + paramSplice.offset);
+				appendParamSlots(derivation.begin() + symSplice.offset, derivation.begin() + symSplice.offset + symSplice.inserted, paramSlots);
+				paramSlots.insert(paramSlots.end(), dt.paramSlots.begin() + paramSplice.offset + paramSplice.removed, dt.paramSlots.end());
+			}
+
 			bool structurallyEquivalentTo(StructurePtr other)
 			{
 				std::shared_ptr<DerivationTree<RealNum>> dt = dynamic_pointer_cast<DerivationTree<RealNum>>(other);
 				if (!dt) return false;
 
+				// Differing hashes settle it in O(1); equal hashes are (almost certainly) equivalent,
+				// but we confirm so that a hash collision can never be mistaken for equivalence.
+				if (hash != dt->hash) return false;
+
 				// Linearize variables. Check that they are all of the same type
 				// and made the same structural choices.
 				typename String<RealNum>::type vars1;
 				typename String<RealNum>::type vars2;
 				this->variables(vars1);
 				dt->variables(vars2);
+				if (vars1.size() != vars2.size())
+					return false;
 				for (unsigned int i = 0; i < vars1.size(); i++)
 				{
 					auto v1 = static_pointer_cast<Variable<RealNum>>(vars1[i]);
 					auto v2 = static_pointer_cast<Variable<RealNum>>(vars2[i]);
-					if (typeid(v1) != typeid(v2) || v1->unrolledProduction != v2->unrolledProduction)
+					if (typeid(*v1) != typeid(*v2) || v1->unrolledProduction != v2->unrolledProduction)
 						return false;
 				}
 				return true;
 			}
 
-			void reroll(Variable<RealNum>& v)
+			// The value tree is a double-valued twin of this tree, built on first request. Evaluating
+			// log probabilities on it (after setParams) keeps value-only evaluations off the AD tape.
+			std::shared_ptr<DerivationTree<double>> valueTree() const
 			{
-				v.unroll();
-				computeDerivation();
+				if (!valueTwin)
+				{
+					valueTwin = std::shared_ptr<DerivationTree<double>>(new DerivationTree<double>);
+					for (auto r : roots)
+						valueTwin->roots.push_back(r->valueDeepCopy());
+					valueTwin->updateStructuralHash();
+					valueTwin->computeDerivation();
+
+					// Pair up corresponding symbols (the twin has identical shape)
+					std::stack<std::pair<Symbol<RealNum>*, Symbol<double>*>> fringe;
+					for (unsigned int i = 0; i < roots.size(); i++)
+						fringe.push(std::make_pair(roots[i].get(), valueTwin->roots[i].get()));
+					while (!fringe.empty())
+					{
+						auto p = fringe.top();
+						fringe.pop();
+						valueTwinSymbols[p.first] = p.second;
+						if (p.first->numChildren() > 0)
+						{
+							const auto& c1 = p.first->children();
+							const auto& c2 = p.second->children();
+							for (unsigned int i = 0; i < c1.size(); i++)
+								fringe.push(std::make_pair(c1[i].get(), c2[i].get()));
+						}
+					}
+				}
+				return valueTwin;
 			}
 
+			// The twin of one of this tree's symbols
+			Symbol<double>* valueSymbol(const Symbol<RealNum>* s) const
+			{
+				valueTree();
+				return valueTwinSymbols.find(s)->second;
+			}
+
+			uint64_t structuralHash() const { return hash; }
+			uint64_t mirrorStructuralHash() const { return mirrorHash; }
+
 			void printFullTree(std::ostream& out) const
 			{
-				std::stack<typename SymbolPtr<RealNum>::type> fringe;
+				std::stack<const Symbol<RealNum>*> fringe;
 				for (auto it = roots.rbegin(); it != roots.rend(); it++)
-					fringe.push(*it);
+					fringe.push(it->get());
 				while (!fringe.empty())
 				{
-					typename SymbolPtr<RealNum>::type s = fringe.top();
+					const Symbol<RealNum>* s = fringe.top();
 					fringe.pop();
 					for (unsigned int i = 0; i < s->depth; i++)
 						out << "  ";
@@ -318,14 +669,14 @@ namespace simference
 					{
 						const auto& children = s->children();
 						for (auto it = children.rbegin(); it != children.rend(); it++)
-							fringe.push(*it);
+							fringe.push(it->get());
 					}
 				}
 			}
 
 			void printDerivation(std::ostream& out) const
 			{
-				for (auto sym : derivation)
+				for (const auto& sym : derivation)
 					sym->print(out);
 				out << std::endl;
 			}
@@ -333,7 +684,7 @@ namespace simference
 			RealNum structureLogProb() const
 			{
 				RealNum lp = 0.0;
-				for (auto sym : roots)
+				for (const auto& sym : roots)
 					lp += sym->recursiveStructureLogProb();
 				return lp;
 			}
@@ -341,7 +692,7 @@ namespace simference
 			RealNum paramLogProb() const
 			{
 				RealNum lp = 0.0;
-				for (auto sym : roots)
+				for (const auto& sym : roots)
 					lp += sym->recursiveParamLogProb();
 				return lp;
 			}
@@ -349,61 +700,81 @@ namespace simference
 			RealNum logProb() const
 			{
 				RealNum lp = 0.0;
-				for (auto sym : roots)
+				for (const auto& sym : roots)
 					lp += sym->recursiveLogProb();
 				return lp;
 			}
 
-			unsigned int numParams() const
-			{
-				unsigned int n = 0;
-				for (auto sym : derivation)
-					n += sym->numParams();
-				return n;
-			}
+			unsigned int numParams() const { return nParams; }
 
 			void getParams(std::vector<RealNum>& p) const
 			{
-				for (auto sym : derivation)
-					sym->getParams(p);
+				for (auto slot : paramSlots)
+					p.push_back(*slot);
 			}
 
+			// Parameters are laid out along the derivation. The slots are gathered once per tree,
+			// so setting them is a straight copy.
 			void setParams(const ParameterVector<RealNum>& p)
 			{
-				unsigned int pindex = 0;
-				for (auto sym : derivation)
-					sym->setParams(p, pindex);
+				for (unsigned int i = 0; i < nParams; i++)
+					*paramSlots[i] = p[i];
+			}
+
+			// Value-only parameters are set on the value tree
+			void bindParams(const ParameterVector<stan::agrad::var>& p) { bindParams(this, p); }
+			void bindParams(const ParameterVector<double>& p) { bindParams(this, p); }
+
+			// Combines the (already up-to-date) hashes of the roots
+			void updateStructuralHash()
+			{
+				hash = mirrorHash = hashMix(roots.size());
+				for (const auto& sym : roots)
+				{
+					hash = hashCombine(hash, sym->subtreeHash);
+					mirrorHash = hashCombine(mirrorHash, sym->subtreeMirrorHash);
+				}
 			}
 
 			void computeDerivation()
 			{
 				derivation.clear();
-				stack<typename SymbolPtr<RealNum>::type> fringe;
-				for (auto it = roots.rbegin(); it != roots.rend(); it++)
-					fringe.push(*it);
+				appendLeaves(roots, derivation);
+				paramSlots.clear();
+				appendParamSlots(derivation.begin(), derivation.end(), paramSlots);
+				nParams = paramSlots.size();
+			}
+
+			// The traversals below walk pointers to the tree's own shared pointers, so that only
+			// the symbols they output have their reference counts touched.
+			static void appendLeaves(const typename String<RealNum>::type& syms, typename String<RealNum>::type& leaves)
+			{
+				stack<const typename SymbolPtr<RealNum>::type*> fringe;
+				for (auto it = syms.rbegin(); it != syms.rend(); it++)
+					fringe.push(&*it);
 				while (!fringe.empty())
 				{
-					auto s = fringe.top();
+					const auto& s = *fringe.top();
 					fringe.pop();
 					if (s->numChildren() == 0)
-						derivation.push_back(s);
+						leaves.push_back(s);
 					else
 					{
 						const auto& children = s->children();
 						for (auto it = children.crbegin(); it != children.crend(); it++)
-							fringe.push(*it);
+							fringe.push(&*it);
 					}
 				}
 			}
 
 			void variables(typename String<RealNum>::type& vars) const
 			{
-				stack<typename SymbolPtr<RealNum>::type> fringe;
+				stack<const typename SymbolPtr<RealNum>::type*> fringe;
 				for (auto it = roots.rbegin(); it != roots.rend(); it++)
-					fringe.push(*it);
+					fringe.push(&*it);
 				while (!fringe.empty())
 				{
-					auto s = fringe.top();
+					const auto& s = *fringe.top();
 					fringe.pop();
 					if (s->is<Variable<RealNum>>())
 						vars.push_back(s);
@@ -411,13 +782,25 @@ namespace simference
 					{
 						const auto& children = s->children();
 						for (auto it = children.crbegin(); it != children.crend(); it++)
-							fringe.push(*it);
+							fringe.push(&*it);
 					}
 				}
 			}
 
 			typename String<RealNum>::type roots;
 			typename String<RealNum>::type derivation;
+			uint64_t hash;
+			uint64_t mirrorHash;
+
+			// Replacement of 'removed' consecutive entries of a sequence, starting at 'offset', by 'inserted' new ones
+			class Splice
+			{
+			public:
+				Splice() : offset(0), removed(0), inserted(0) {}
+				unsigned int offset;
+				unsigned int removed;
+				unsigned int inserted;
+			};
 
 			class Provenance
 			{
@@ -427,8 +810,52 @@ namespace simference
 				// We could at some point generalize this to be an arbitrary number of old/new subtree pairs?
 				typename SymbolPtr<RealNum>::type oldSubtreeRoot;
 				typename SymbolPtr<RealNum>::type newSubtreeRoot;
+				// How the derivation (and the parameter vector laid out along it) changed from 'modifiedFrom'
+				Splice derivationSplice;
+				Splice paramSplice;
 			};
 			Provenance provenance;
+
+		private:
+			unsigned int nParams;
+			std::vector<RealNum*> paramSlots;
+
+			static void appendParamSlots(typename String<RealNum>::type::const_iterator begin,
+				typename String<RealNum>::type::const_iterator end, std::vector<RealNum*>& slots)
+			{
+				for (auto it = begin; it != end; it++)
+				{
+					RealNum* storage = (*it)->paramStorage();
+					for (unsigned int i = 0; i < (*it)->numParams(); i++)
+						slots.push_back(storage + i);
+				}
+			}
+
+			template<typename T>
+			static void bindParams(DerivationTree<T>* dt, const ParameterVector<T>& p) { dt->setParams(p); }
+			static void bindParams(DerivationTree<stan::agrad::var>* dt, const ParameterVector<double>& p) { dt->valueTree()->setParams(p); }
+			static void bindParams(DerivationTree<double>* dt, const ParameterVector<stan::agrad::var>& p)
+			{ throw "DerivationTree::bindParams - Can't bind AD parameters to a value tree!"; }
+
+			// Child indices leading from 'syms' down to 'target' (searching no deeper than the target)
+			static bool findPath(const typename String<RealNum>::type& syms, const Symbol<RealNum>* target,
+				std::vector<unsigned int>& path)
+			{
+				for (unsigned int i = 0; i < syms.size(); i++)
+				{
+					path.push_back(i);
+					if (syms[i].get() == target)
+						return true;
+					if (syms[i]->numChildren() > 0 && syms[i]->depth < target->depth &&
+						findPath(syms[i]->children(), target, path))
+						return true;
+					path.pop_back();
+				}
+				return false;
+			}
+
+			mutable std::shared_ptr<DerivationTree<double>> valueTwin;
+			mutable std::unordered_map<const Symbol<RealNum>*, Symbol<double>*> valueTwinSymbols;
 		};
 	}
 }
@@ -1,8 +1,10 @@
 #include "GrammarInference.h"
+#include "FusedAD.h"
 #include <stack>
 
 using namespace std;
 using namespace simference::Grammar;
+using namespace simference::Math::Probability;
 using namespace stan::agrad;
 
 namespace simference
@@ -36,9 +38,12 @@ namespace simference
 		GrammarFactorTemplate::Factor::Factor(StructurePtr dtree,
 					   const String<var>::type & roots,
 					   const unordered_set<SymbolPtr<var>::type>& exclude)
-					   : simference::Models::Factor(dtree)
+					   : simference::Models::Factor(dtree), structureLp(0.0)
 		{
-			// Extract all descendants of 'roots,' except descendants of those in the 'exclude' set
+			// Extract all descendants of 'roots,' except descendants of those in the 'exclude' set.
+			// Their structure log probabilities are constant; only those with parameters need evaluating.
+			auto dt = static_cast<DerivationTree<var>*>(dtree.get());
+			unordered_set<const Symbol<var>*> withParams;
 			stack<SymbolPtr<var>::type> fringe;
 			for (auto s : roots) fringe.push(s);
 			while (!fringe.empty())
@@ -47,30 +52,120 @@ namespace simference
 				fringe.pop();
 				if (exclude.count(s) == 0)
 				{
-					syms.push_back(s);
+					structureLp += s->localStructureLogProb();
+					if (s->numParams() > 0)
+						withParams.insert(s.get());
 					if (s->numChildren() > 0)
 					{
 						const auto& children = s->children();
-						for (auto c : children)
+						for (const auto& c : children)
 							fringe.push(c);
 					}
 				}
 			}
+
+			// Flatten their priors, in parameter order
+			unsigned int pindex = 0;
+			for (const auto& s : dt->derivation)
+			{
+				unsigned int n = s->numParams();
+				if (withParams.count(s.get()) > 0)
+				{
+					vector<FlatDistribution> flat;
+					bool opaque = false;
+					for (unsigned int i = 0; i < n; i++)
+					{
+						auto d = s->paramDistribution(i);
+						flat.push_back(d ? d->flatten() : FlatDistribution());
+						opaque = opaque || flat.back().kind == FlatDistribution::Opaque;
+					}
+					if (!opaque)
+					{
+						for (unsigned int i = 0; i < n; i++)
+						{
+							priorParam.push_back(pindex + i);
+							priorKind.push_back(flat[i].kind);
+							priorMean.push_back(flat[i].mean);
+							priorSD.push_back(flat[i].sd);
+							priorLo.push_back(flat[i].lo);
+							priorHi.push_back(flat[i].hi);
+							priorLogNormalizer.push_back(flat[i].logNormalizer);
+						}
+					}
+					else
+					{
+						syms.push_back(s);
+						valueSyms.push_back(dt->valueSymbol(s.get()));
+					}
+				}
+				pindex += n;
+			}
+			values.resize(priorParam.size());
+			partials.resize(priorParam.size());
+			operands.resize(priorParam.size());
+			recordedOperands.resize(priorParam.size());
+			priorKernel.factor = this;
+		}
+
+		double GrammarFactorTemplate::Factor::priorLogProb(const double* x, double* dlp) const
+		{
+			double lp = 0.0;
+			unsigned int n = priorParam.size();
+			for (unsigned int i = 0; i < n; i++)
+			{
+				if (x[i] > priorLo[i] && x[i] < priorHi[i])
+				{
+					double z = priorKind[i] == FlatDistribution::Uniform ? 0.0 : (x[i] - priorMean[i]) / priorSD[i];
+					lp += priorLogNormalizer[i] - 0.5*z*z;
+					dlp[i] = -z / priorSD[i];
+				}
+				else
+				{
+					lp = -numeric_limits<double>::infinity();
+					dlp[i] = 0.0;
+				}
+			}
+			return lp;
 		}
 
 		var GrammarFactorTemplate::Factor::log_prob(const ParameterVector<var>& params)
 		{
-			var lp = 0.0;
+			// The flattened priors go on the tape as one node
+			for (unsigned int i = 0; i < priorParam.size(); i++)
+			{
+				operands[i] = params[priorParam[i]];
+				values[i] = operands[i].val();
+			}
+			double priorLp = priorLogProb(values.data(), partials.data());
+			var lp = structureLp + AD::fused(priorLp, operands.size(), operands.data(), partials.data());
 
-			// Set the parameters of the derivation
-			static_pointer_cast<DerivationTree<var>>(structUnrolledFrom)->setParams(params);
+			// Any other symbols are evaluated one by one (FactorModel has set their parameters)
+			for (const auto& s : syms)
+				lp += s->logProb();
+
+			return lp;
+		}
+
+		double GrammarFactorTemplate::Factor::log_prob(const ParameterVector<double>& params)
+		{
+			for (unsigned int i = 0; i < priorParam.size(); i++)
+				values[i] = params[priorParam[i]];
+			double lp = structureLp + priorLogProb(values.data(), partials.data());
 
-			// Accumulate probabilities for all the symbols we've been told to care about
-			for (auto s : syms)
+			// Same as above, but on the double-valued twin of the derivation
+			for (auto s : valueSyms)
 				lp += s->logProb();
 
 			return lp;
 		}
+
+		AD::Recorded GrammarFactorTemplate::Factor::log_prob(const ParameterVector<AD::Recorded>& params)
+		{
+			// Only recordable without opaque priors, so the flattened priors are the whole factor
+			for (unsigned int i = 0; i < priorParam.size(); i++)
+				recordedOperands[i] = params[priorParam[i]];
+			return structureLp + AD::call(priorKernel, recordedOperands.size(), recordedOperands.data());
+		}
 	}
 
 	namespace Samplers
@@ -79,7 +174,7 @@ namespace simference
 		{
 			// Pick a random nonterminal and reroll it.
 			// (Don't forget to store the correct information in the 'provenance' field)
-			// NOTE: This requires deep copy!
+			// The proposed tree shares everything but the path to the rerolled variable with the current one.
 			// We also precompute and store the forward/reverse proposal probabilities.
 
 			auto variableUnrollProbs = [](const String<var>::type& vars, vector<double>& probs)
@@ -103,92 +198,44 @@ namespace simference
 			vector<var> currP; for (auto p : currentParams) currP.push_back(p);
 			currdt->setParams(currP);
 
-			// Deep copy
-			auto newdt = shared_ptr<DerivationTree<var>>(new DerivationTree<var>(*currdt));
-			
 			// Decide which variable to reroll
 			vector<SymbolPtr<var>::type> currvars, newvars;
 			currdt->variables(currvars);
-			newdt->variables(newvars);
 			vector<double> probabilities;
 			variableUnrollProbs(currvars, probabilities);
 			unsigned int whichVar = MultinomialDistribution<double>::Sample(probabilities);
 
-			// Re-roll variable in the newly copied tree
-			newdt->reroll(*newvars[whichVar]->as<Variable<var>>());
-
-			// Record provenance
+			// Copy the tree with that variable rerolled (this records the old/new subtrees)
+			auto newdt = shared_ptr<DerivationTree<var>>(new DerivationTree<var>(*currdt, currvars[whichVar]));
 			newdt->provenance.modifiedFrom = std::static_pointer_cast<DerivationTree<var>>(currentStruct);
-			newdt->provenance.oldSubtreeRoot = currvars[whichVar];
-			newdt->provenance.newSubtreeRoot = newvars[whichVar];
 
 			// Record the forward and reverse probabilities (as well as the structures)
 			lastStructJumpedFrom = currentStruct;
 			lastStructJumpedTo = newdt;
-			lastJumpForwardLp = log(MultinomialDistribution<double>::Prob(whichVar, probabilities)) + newvars[whichVar]->recursiveStructureLogProb().val();
-			newvars.clear();
+			lastJumpForwardLp = log(MultinomialDistribution<double>::Prob(whichVar, probabilities)) + newdt->provenance.newSubtreeRoot->subtreeStructureLogProb;
 			probabilities.clear();
 			newdt->variables(newvars);
 			variableUnrollProbs(newvars, probabilities);
-			lastJumpReverseLp = log(MultinomialDistribution<double>::Prob(whichVar, probabilities)) + currvars[whichVar]->recursiveStructureLogProb().val();
+			lastJumpReverseLp = log(MultinomialDistribution<double>::Prob(whichVar, probabilities)) + currvars[whichVar]->subtreeStructureLogProb;
 
 
-			// Traverse sOld, linearizing the parameters, but skip the replaced node. Remember the index in the list where the skip happened.
-			// Linearize the old and new subtrees; slap the old params on top of the new ones.
-			// Build the map (should be pretty simple)
+			// The parameters are laid out along the derivation, so the splice that turned the old derivation
+			// into the new one says where the old subtree's parameters sit. The extended parameter list is
+			// the old list with the new subtree's parameters inserted right after the old subtree's.
+			const auto& splice = newdt->provenance.paramSplice;
+			unsigned int skipPoint = splice.offset;
+			unsigned int numOldTreeParams = splice.removed;
+			vector<var> newTreeParams;
+			const auto& newDerivation = newdt->derivation;
+			const auto& symSplice = newdt->provenance.derivationSplice;
+			for (unsigned int i = symSplice.offset; i < symSplice.offset + symSplice.inserted; i++)
+				newDerivation[i]->getParams(newTreeParams);
 
-			auto linearizeParams = [](const String<var>::type& roots, SymbolPtr<var>::type skip, vector<var>& outParams, unsigned int& skipPoint)
-			{
-				stack<SymbolPtr<var>::type> fringe;
-				for (auto it = roots.rbegin(); it != roots.rend(); it++)
-					fringe.push(*it);
-				while (!fringe.empty())
-				{
-					auto s = fringe.top();
-					fringe.pop();
-					if (s.get() == skip.get()) 
-					{
-						skipPoint = outParams.size();
-						continue;
-					}
-					s->getParams(outParams);
-					if (s->numChildren() > 0)
-					{
-						auto children = s->children();
-						for (auto it = children.rbegin(); it != children.rend(); it++)
-							fringe.push(*it);
-					}
-				}
-			};
-			
-			// Linearize parameters, but skip the old subtree
-			vector<var> params;
-			unsigned int skipPoint;
-			auto skipVar = newdt->provenance.oldSubtreeRoot;
-			linearizeParams(currdt->roots, skipVar, params, skipPoint);
-
-			// Linearize the old and new subtrees
-			vector<var> oldTreeParams, newTreeParams;
-			unsigned int dummySkipPoint;
-			String<var>::type roots;
-			roots.push_back(newdt->provenance.oldSubtreeRoot);
-			linearizeParams(roots, SymbolPtr<var>::type(NULL), oldTreeParams, dummySkipPoint);
-			roots.clear(); roots.push_back(newdt->provenance.newSubtreeRoot);
-			linearizeParams(roots, SymbolPtr<var>::type(NULL), newTreeParams, dummySkipPoint);
-
-			// Unify the old+new subtree params
-			vector<var> unifiedSubtreeParams;
-			unifiedSubtreeParams.insert(unifiedSubtreeParams.end(), oldTreeParams.begin(), oldTreeParams.end());
-			unifiedSubtreeParams.insert(unifiedSubtreeParams.end(), newTreeParams.begin(), newTreeParams.end());
-
-			// Insert the unified subtree param list into the overall extended param list
-			// (Meanwhile, convert to doubles)
-			for (unsigned int i = 0; i < skipPoint; i++)
-				extendedParams.push_back(params[i].val());
-			for (auto p : unifiedSubtreeParams)
+			extendedParams.insert(extendedParams.end(), currentParams.begin(), currentParams.begin() + skipPoint + numOldTreeParams);
+			for (auto p : newTreeParams)
 				extendedParams.push_back(p.val());
-			for (unsigned int i = skipPoint; i < params.size(); i++)
-				extendedParams.push_back(params[i].val());
+			extendedParams.insert(extendedParams.end(), currentParams.begin() + skipPoint + numOldTreeParams, currentParams.end());
+			unsigned int numSubtreeParams = numOldTreeParams + newTreeParams.size();
 
 			// Build the parameter index maps
 			vector<unsigned int> oldMap, newMap;
@@ -197,11 +244,11 @@ namespace simference
 				oldMap.push_back(i);
 				newMap.push_back(i);
 			}
-			for (unsigned int i = skipPoint; i < skipPoint + oldTreeParams.size(); i++)
+			for (unsigned int i = skipPoint; i < skipPoint + numOldTreeParams; i++)
 				oldMap.push_back(i);
-			for (unsigned int i = skipPoint + oldTreeParams.size(); i < skipPoint + unifiedSubtreeParams.size(); i++)
+			for (unsigned int i = skipPoint + numOldTreeParams; i < skipPoint + numSubtreeParams; i++)
 				newMap.push_back(i);
-			for (unsigned int i = skipPoint + unifiedSubtreeParams.size(); i < extendedParams.size(); i++)
+			for (unsigned int i = skipPoint + numSubtreeParams; i < extendedParams.size(); i++)
 			{
 				oldMap.push_back(i);
 				newMap.push_back(i);
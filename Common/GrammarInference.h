@@ -23,8 +23,38 @@ namespace simference
 					   const simference::Grammar::String<stan::agrad::var>::type & roots,
 					   const std::unordered_set<simference::Grammar::SymbolPtr<stan::agrad::var>::type>& exclude);
 				stan::agrad::var log_prob(const ParameterVector<stan::agrad::var>& params);
+				double log_prob(const ParameterVector<double>& params);
+				AD::Recorded log_prob(const ParameterVector<AD::Recorded>& params);
+				bool readsStructureParams() const { return !syms.empty(); }
+				bool recordable() const { return syms.empty(); }
 			private:
+				// Sum of the flattened priors at 'values' (gathered from the parameter vector), along with
+				// its partial derivatives
+				double priorLogProb(const double* values, double* partials) const;
+
+				// priorLogProb as a tape kernel
+				class PriorKernel : public AD::Kernel
+				{
+				public:
+					double evaluate(unsigned int n, const double* inputs, double* partials) const
+					{ return factor->priorLogProb(inputs, partials); }
+					const Factor* factor;
+				};
+				PriorKernel priorKernel;
+
+				double structureLp;
+
+				// The parameter priors, flattened (see FlatDistribution)
+				std::vector<unsigned int> priorParam;
+				std::vector<Math::Probability::FlatDistribution::Kind> priorKind;
+				std::vector<double> priorMean, priorSD, priorLo, priorHi, priorLogNormalizer;
+				std::vector<double> values, partials;
+				std::vector<stan::agrad::var> operands;
+				std::vector<AD::Recorded> recordedOperands;
+
+				// Symbols with priors that can't be flattened
 				std::vector<simference::Grammar::SymbolPtr<stan::agrad::var>::type> syms;
+				std::vector<simference::Grammar::Symbol<double>*> valueSyms;	// twins of 'syms' in the value tree
 			};
 		};
 	}
@@ -1,5 +1,6 @@
 #include "Model.h"
 #include <cassert>
+#include <limits>
 
 using namespace stan::agrad;
 using namespace std;
@@ -26,32 +27,119 @@ namespace simference
 
 	namespace Models
 	{
+		double Model::grad_log_prob(vector<double>& params_r, vector<int>& params_i,
+			vector<double>& gradient, ostream* output_stream)
+		{
+			AD::EvaluationScope scope;
+			vector<var> ad_params_r(params_r.begin(), params_r.end());
+			var lp = log_prob(ad_params_r, params_i, output_stream);
+			stan::agrad::grad(lp.vi_);
+			gradient.resize(ad_params_r.size());
+			for (unsigned int i = 0; i < ad_params_r.size(); i++)
+				gradient[i] = ad_params_r[i].adj();
+			return lp.val();
+		}
 
 		FactorModel::FactorModel(StructurePtr s, unsigned int nParams, const vector<FactorPtr>& fs)
-			: Model(nParams), structUnrolledFrom(s), factors(fs)
+			: Model(nParams), structUnrolledFrom(s), factors(fs), bindsParams(false), recordable(true)
 		{
 			bool allSameUnrollSource = true;
-			for (auto f : factors) allSameUnrollSource &= (structUnrolledFrom == f->structUnrolledFrom);
+			for (auto f : factors)
+			{
+				allSameUnrollSource &= (structUnrolledFrom == f->structUnrolledFrom);
+				bindsParams = bindsParams || f->readsStructureParams();
+				recordable = recordable && f->recordable();
+			}
 			assert(allSameUnrollSource);
+			// Parameters can't be bound to the structure as recorded scalars
+			recordable = recordable && !bindsParams;
+		}
+
+		bool FactorModel::replayEnabled = true;
+
+		ParameterVector<var> FactorModel::wrapParameters(const vector<var>& params_r)
+		{
+			return ParameterVector<var>(params_r);
+		}
+
+		ParameterVector<double> FactorModel::wrapParameters(const vector<double>& params_r)
+		{
+			return ParameterVector<double>(params_r);
+		}
+
+		ParameterVector<AD::Recorded> FactorModel::wrapParameters(const vector<AD::Recorded>& params_r)
+		{
+			return ParameterVector<AD::Recorded>(params_r);
 		}
 
-		ParameterVectorPtr<var>::type FactorModel::wrapParameters(const vector<var>& params_r) const
+		template<typename RealNum>
+		RealNum FactorModel::sumFactors(const ParameterVector<RealNum>& params)
 		{
-			return ParameterVectorPtr<var>::type(new ParameterVector<var>(params_r));
+			RealNum lp = 0.0;
+			for (const auto& f : factors)
+				lp += f->log_prob(params);
+			return lp;
 		}
 
 		var FactorModel::log_prob(const vector<var>& params_r)
 		{
-			ParameterVectorPtr<var>::type params = wrapParameters(params_r);
-			var lp = 0.0;
-			for (auto f : factors)
-				lp += f->log_prob(*params);
+			ParameterVector<var> params = wrapParameters(params_r);
+			if (bindsParams)
+				structUnrolledFrom->bindParams(params);
+			return sumFactors(params);
+		}
+
+		double FactorModel::log_prob(const vector<double>& params_r)
+		{
+			ParameterVector<double> params = wrapParameters(params_r);
+			if (bindsParams)
+				structUnrolledFrom->bindParams(params);
+			return sumFactors(params);
+		}
+
+		double FactorModel::grad_log_prob(vector<double>& params_r, vector<int>& params_i,
+			vector<double>& gradient, ostream* output_stream)
+		{
+			if (!(replayEnabled && recordable))
+				return Model::grad_log_prob(params_r, params_i, gradient, output_stream);
+
+			double lp;
+			if (tape.isRecorded() && tape.replay(params_r, lp, gradient))
+				return lp;
+
+			// Nothing recorded yet, or the recording branched differently than these parameters do
+			{
+				AD::Tape::Recording recording(tape, params_r, recordedParams);
+				recording.finish(sumFactors(wrapParameters(recordedParams)));
+			}
+			if (!tape.replay(params_r, lp, gradient))
+				return Model::grad_log_prob(params_r, params_i, gradient, output_stream);
 			return lp;
 		}
 
-		ParameterVectorPtr<var>::type DimensionMatchedFactorModel::wrapParameters(const vector<var>& params_r) const
+		ParameterVector<var> DimensionMatchedFactorModel::wrapParameters(const vector<var>& params_r)
+		{
+			return gather(params_r, mappedParams);
+		}
+
+		ParameterVector<double> DimensionMatchedFactorModel::wrapParameters(const vector<double>& params_r)
+		{
+			return gather(params_r, mappedValues);
+		}
+
+		ParameterVector<AD::Recorded> DimensionMatchedFactorModel::wrapParameters(const vector<AD::Recorded>& params_r)
+		{
+			return gather(params_r, mappedRecorded);
+		}
+
+		template<typename RealNum>
+		ParameterVector<RealNum> DimensionMatchedFactorModel::gather(const vector<RealNum>& params_r, vector<RealNum>& mapped) const
 		{
-			return ParameterVectorPtr<var>::type(new DimensionMatchedParameterVector<var>(params_r, paramIndexMap));
+			unsigned int n = paramIndexMap.size();
+			mapped.resize(n);
+			for (unsigned int i = 0; i < n; i++)
+				mapped[i] = params_r[paramIndexMap[i]];
+			return ParameterVector<RealNum>(mapped);
 		}
 
 		void FactorTemplate::unroll(StructurePtr sOld, StructurePtr sNew,
@@ -66,6 +154,7 @@ namespace simference
 		void FactorTemplateModel::addTemplate(FactorTemplatePtr t)
 		{
 			templates.push_back(t);
+			clearCache();
 		}
 
 		void FactorTemplateModel::removeTemplate(FactorTemplatePtr t)
@@ -75,17 +164,73 @@ namespace simference
 				if (*it == t)
 				{
 					templates.erase(it);
+					clearCache();
 					return;
 				}
 			}
 		}
 
+		void FactorTemplateModel::setCacheCapacity(unsigned int cap)
+		{
+			cacheCapacity = cap;
+			while (unrollCache.size() > cacheCapacity)
+				evictLeastRecentlyUsed();
+		}
+
+		void FactorTemplateModel::evictLeastRecentlyUsed() const
+		{
+			auto last = --unrollCache.end();
+			auto range = unrollCacheIndex.equal_range(last->hash);
+			for (auto it = range.first; it != range.second; it++)
+			{
+				if (it->second == last)
+				{
+					unrollCacheIndex.erase(it);
+					break;
+				}
+			}
+			unrollCache.pop_back();
+		}
+
+		void FactorTemplateModel::clearCache() const
+		{
+			unrollCache.clear();
+			unrollCacheIndex.clear();
+		}
+
 		ModelPtr FactorTemplateModel::unroll(StructurePtr s) const
 		{
+			// Cache hit: move the entry to the front of the LRU list and hand back the model we already built.
+			// A model unrolled from an equivalent structure computes the same density over the same parameter
+			// layout, so it is a valid model for this one. Note that it binds parameters to the tree it was
+			// unrolled from (its structUnrolledFrom), which on a hit is that equivalent twin rather than 's':
+			// callers must not expect evaluating the returned model to fill in 's's parameters.
+			uint64_t hash = s->structuralHash();
+			auto range = unrollCacheIndex.equal_range(hash);
+			for (auto it = range.first; it != range.second; it++)
+			{
+				auto entry = it->second;
+				if (entry->structure == s || s->structurallyEquivalentTo(entry->structure))
+				{
+					unrollCache.splice(unrollCache.begin(), unrollCache, entry);
+					return entry->model;
+				}
+			}
+
 			vector<FactorPtr> factors;
 			for (auto t : templates)
 				t->unroll(s, factors);
-			return ModelPtr(new FactorModel(s, s->numParams(), factors));
+			ModelPtr model(new FactorModel(s, s->numParams(), factors));
+
+			if (cacheCapacity > 0)
+			{
+				unrollCache.push_front(CacheEntry(s, hash, model));
+				unrollCacheIndex.insert(make_pair(hash, unrollCache.begin()));
+				if (unrollCache.size() > cacheCapacity)
+					evictLeastRecentlyUsed();
+			}
+
+			return model;
 		}
 
 		void FactorTemplateModel::unroll(StructurePtr sOld, StructurePtr sNew, const DimensionMatchMap& dimMatch,
@@ -122,9 +267,47 @@ namespace simference
 
 		var MixtureModel::log_prob(const vector<var>& params_r)
 		{
+			lastComponentLps.assign(models.size(), numeric_limits<double>::quiet_NaN());
 			var lp = 0.0;
 			for (unsigned int i = 0; i < models.size(); i++)
-				lp += weights[i] * models[i]->log_prob(params_r);
+			{
+				if (weights[i] == 0.0) continue;
+				var mlp = models[i]->log_prob(params_r);
+				lastComponentLps[i] = mlp.val();
+				lp += weights[i] * mlp;
+			}
+			return lp;
+		}
+
+		double MixtureModel::log_prob(const vector<double>& params_r)
+		{
+			lastComponentLps.assign(models.size(), numeric_limits<double>::quiet_NaN());
+			double lp = 0.0;
+			for (unsigned int i = 0; i < models.size(); i++)
+			{
+				if (weights[i] == 0.0) continue;
+				lastComponentLps[i] = models[i]->log_prob(params_r);
+				lp += weights[i] * lastComponentLps[i];
+			}
+			return lp;
+		}
+
+		void MixtureModel::componentLogProbs(const vector<double>& params_r, vector<double>& componentLps)
+		{
+			componentLps.resize(models.size());
+			for (unsigned int i = 0; i < models.size(); i++)
+				componentLps[i] = models[i]->log_prob(params_r);
+			lastComponentLps = componentLps;
+		}
+
+		double MixtureModel::combineComponents(const vector<double>& componentLps) const
+		{
+			double lp = 0.0;
+			for (unsigned int i = 0; i < models.size(); i++)
+			{
+				if (weights[i] == 0.0) continue;
+				lp += weights[i] * componentLps[i];
+			}
 			return lp;
 		}
 	}
@@ -1,20 +1,42 @@
 #ifndef __MODEL_H
 #define __MODEL_H
 
+#include "EvaluationScope.h"
+#include "ReplayAD.h"
 #include <stan/model/prob_grad_ad.hpp>
+#include <cstdint>
 #include <functional>
+#include <list>
+#include <unordered_map>
 
 namespace simference
 {
+	template <typename RealNum> class ParameterVector;
+
 	class Structure
 	{
 	public:
 		virtual unsigned int numParams() const = 0;
 		virtual bool structurallyEquivalentTo(std::shared_ptr<Structure> other) = 0;
+
+		// Structurally equivalent structures must hash equal; unequal hashes mean non-equivalent structures.
+		virtual uint64_t structuralHash() const = 0;
+		// Like structuralHash, but also identifies structures that differ only by mirror symmetries
+		// (if the structure type has any).
+		virtual uint64_t mirrorStructuralHash() const { return structuralHash(); }
+
+		// Stores parameter values in the structure itself, for factors that read them from there
+		// (see Factor::readsStructureParams). Structures that don't hold their parameters ignore this.
+		virtual void bindParams(const ParameterVector<stan::agrad::var>& params) {}
+		virtual void bindParams(const ParameterVector<double>& params) {}
 	};
 
 	typedef std::shared_ptr<Structure> StructurePtr;
 
+	// Plain value of a (possibly autodiff) scalar
+	inline double valueOf(double x) { return x; }
+	inline double valueOf(const stan::agrad::var& x) { return x.val(); }
+
 	class DimensionMatchMap
 	{
 	public:
@@ -32,36 +54,20 @@ namespace simference
 		static std::vector<double> translate(const std::vector<double>& extendedParams, const std::vector<unsigned int>& indexMap);
 	};
 
+	// A read-only view of contiguous parameters. It doesn't own them, and is cheap to pass by value.
 	template <typename RealNum>
 	class ParameterVector
 	{
 	public:
 		ParameterVector(const std::vector<RealNum>& p)
-			: params(p) {}
-		virtual const RealNum& operator[] (unsigned int i) const { return params[i]; }
-		virtual size_t size() const { return params.size(); }
-	protected:
-		const std::vector<stan::agrad::var>& params;
-	};
-
-	template <typename RealNum>
-	class DimensionMatchedParameterVector : public ParameterVector<RealNum>
-	{
-	public:
-		DimensionMatchedParameterVector(const std::vector<RealNum>& p,
-			const std::vector<unsigned int>& imap)
-			: ParameterVector(p), indexMap(imap) {}
-		const RealNum& operator[] (unsigned int i) const { return params[indexMap[i]]; }
-		size_t size() const { return indexMap.size(); }
-	protected:
-		const std::vector<unsigned int>& indexMap;
-	};
-
-	template <typename RealNum>
-	class ParameterVectorPtr
-	{
-	public:
-		typedef std::shared_ptr<ParameterVector<RealNum>> type;
+			: params(p.empty() ? NULL : &p[0]), n(p.size()) {}
+		ParameterVector(const RealNum* p, size_t size)
+			: params(p), n(size) {}
+		const RealNum& operator[] (unsigned int i) const { return params[i]; }
+		size_t size() const { return n; }
+	private:
+		const RealNum* params;
+		size_t n;
 	};
 
 	namespace Models
@@ -77,12 +83,17 @@ namespace simference
 			{
 				return log_prob(params_r);
 			}
-			double log_prob(std::vector<double>& params_r)
+			// Value-only evaluation: runs entirely in double, so it never touches the AD tape.
+			virtual double log_prob(const std::vector<double>& params_r) = 0;
+			double log_prob(std::vector<double>& params_r,
+				std::vector<int>& params_i,
+				std::ostream* output_stream = 0)
 			{
-				return stan::model::prob_grad_ad::log_prob(params_r, dummy);
-			};
-		private:
-			std::vector<int> dummy;
+				return log_prob(params_r);
+			}
+			// Same as stan's, but within an evaluation scope (see AD::EvaluationScope)
+			double grad_log_prob(std::vector<double>& params_r, std::vector<int>& params_i,
+				std::vector<double>& gradient, std::ostream* output_stream = 0);
 		};
 
 		typedef std::shared_ptr<Model> ModelPtr;
@@ -92,6 +103,19 @@ namespace simference
 		public:
 			Factor(StructurePtr s) : structUnrolledFrom(s) {}
 			virtual stan::agrad::var log_prob(const ParameterVector<stan::agrad::var>& params) = 0;
+			virtual double log_prob(const ParameterVector<double>& params) = 0;
+
+			// Factors that can be recorded onto a replayable tape (see AD::Tape) override this
+			// and report themselves recordable.
+			virtual AD::Recorded log_prob(const ParameterVector<AD::Recorded>& params)
+			{
+				throw "Factor::log_prob - Factor cannot be recorded!";
+			}
+			virtual bool recordable() const { return false; }
+
+			// Whether log_prob reads parameters from the structure, rather than only from 'params'.
+			// If any factor does, FactorModel binds the parameters to the structure once per evaluation.
+			virtual bool readsStructureParams() const { return true; }
 
 		protected:
 			friend class FactorModel;
@@ -105,11 +129,28 @@ namespace simference
 		public:
 			FactorModel(StructurePtr s, unsigned int nParams, const std::vector<FactorPtr>& fs);
 			stan::agrad::var log_prob(const std::vector<stan::agrad::var>& params_r); 
+			double log_prob(const std::vector<double>& params_r);
+
+			// If every factor is recordable, the gradient comes from replaying a recording of the
+			// model, which is only re-recorded when the parameters take it down another branch.
+			// Otherwise (or with replay disabled), stan computes it as usual.
+			double grad_log_prob(std::vector<double>& params_r, std::vector<int>& params_i,
+				std::vector<double>& gradient, std::ostream* output_stream = 0);
+			static bool replayEnabled;
 
 		protected:
-			virtual ParameterVectorPtr<stan::agrad::var>::type wrapParameters(const std::vector<stan::agrad::var>& params_r) const;
+			virtual ParameterVector<stan::agrad::var> wrapParameters(const std::vector<stan::agrad::var>& params_r);
+			virtual ParameterVector<double> wrapParameters(const std::vector<double>& params_r);
+			virtual ParameterVector<AD::Recorded> wrapParameters(const std::vector<AD::Recorded>& params_r);
 			StructurePtr structUnrolledFrom;
 			std::vector<FactorPtr> factors;
+			bool bindsParams;
+			bool recordable;
+
+		private:
+			template<typename RealNum> RealNum sumFactors(const ParameterVector<RealNum>& params);
+			AD::Tape tape;
+			std::vector<AD::Recorded> recordedParams;
 		};
 
 		class DimensionMatchedFactorModel : public FactorModel
@@ -120,8 +161,20 @@ namespace simference
 				: FactorModel(s, nParams, fs), paramIndexMap(pim) {}
 
 		protected:
-			ParameterVectorPtr<stan::agrad::var>::type wrapParameters(const std::vector<stan::agrad::var>& params_r) const;
+			// The mapped parameters are gathered into a buffer (reused across evaluations), so factors
+			// read them as contiguous parameters like any others
+			ParameterVector<stan::agrad::var> wrapParameters(const std::vector<stan::agrad::var>& params_r);
+			ParameterVector<double> wrapParameters(const std::vector<double>& params_r);
+			ParameterVector<AD::Recorded> wrapParameters(const std::vector<AD::Recorded>& params_r);
 			std::vector<unsigned int> paramIndexMap;
+
+		private:
+			std::vector<stan::agrad::var> mappedParams;
+			std::vector<double> mappedValues;
+			std::vector<AD::Recorded> mappedRecorded;
+
+			template<typename RealNum>
+			ParameterVector<RealNum> gather(const std::vector<RealNum>& params_r, std::vector<RealNum>& mapped) const;
 		};
 
 		class FactorTemplate
@@ -141,32 +194,70 @@ namespace simference
 		class FactorTemplateModel
 		{
 		public:
-			FactorTemplateModel() {}
+			FactorTemplateModel() : cacheCapacity(DefaultCacheCapacity) {}
 			FactorTemplateModel(const std::vector<FactorTemplatePtr>& ts)
-				: templates(ts) {}
+				: templates(ts), cacheCapacity(DefaultCacheCapacity) {}
 			void addTemplate(FactorTemplatePtr t);
 			void removeTemplate(FactorTemplatePtr t);
 			ModelPtr unroll(StructurePtr s) const;
 			void unroll(StructurePtr sOld, StructurePtr sNew, const DimensionMatchMap& dimMatch,
 				ModelPtr& mOld, ModelPtr& mNew, ModelPtr& mShared) const;
+
+			// Unary unrolls are cached (least-recently-used first out), so that rejected jumps
+			// and revisited structures don't pay to rebuild the same model. Entries are keyed by
+			// structural hash, so a structurally equivalent structure reuses the model unrolled from its twin.
+			// A capacity of zero disables caching.
+			void setCacheCapacity(unsigned int cap);
+			void clearCache() const;
+			static const unsigned int DefaultCacheCapacity = 8;
+
 		private:
 			std::vector<FactorTemplatePtr> templates;
+
+			class CacheEntry
+			{
+			public:
+				CacheEntry(StructurePtr s, uint64_t h, ModelPtr m) : structure(s), hash(h), model(m) {}
+				StructurePtr structure;
+				uint64_t hash;
+				ModelPtr model;
+			};
+			typedef std::list<CacheEntry> UnrollCache;
+			mutable UnrollCache unrollCache;
+			mutable std::unordered_multimap<uint64_t, UnrollCache::iterator> unrollCacheIndex;
+			unsigned int cacheCapacity;
+
+			void evictLeastRecentlyUsed() const;
 		};
 
 		typedef std::shared_ptr<FactorTemplateModel> FactorTemplateModelPtr;
 
 		// Weights are not required to be normalized.
+		// Components whose weight is exactly zero are not evaluated.
 		class MixtureModel : public Model
 		{
 		public:
 			MixtureModel(const std::vector<ModelPtr>& ms, const std::vector<double>& ws);
 			MixtureModel(const std::vector<ModelPtr>& ms);
 			stan::agrad::var log_prob(const std::vector<stan::agrad::var>& params_r);
+			double log_prob(const std::vector<double>& params_r);
 			std::vector<double>& getWeights() { return weights; }
 
+			// Per-component log probabilities from the most recent log_prob call
+			// (NaN for components that were skipped because their weight was zero).
+			const std::vector<double>& lastComponentLogProbs() const { return lastComponentLps; }
+
+			// Evaluates every component at params_r, regardless of weight, so that the
+			// results can be recombined under different weights with combineComponents.
+			void componentLogProbs(const std::vector<double>& params_r, std::vector<double>& componentLps);
+
+			// The mixture log probability implied by per-component log probabilities under the current weights
+			double combineComponents(const std::vector<double>& componentLps) const;
+
 		private:
 			std::vector<ModelPtr> models;
 			std::vector<double> weights;
+			std::vector<double> lastComponentLps;
 		};
 	}
 }
@@ -0,0 +1,367 @@
+#ifndef __REPLAY_AD_H
+#define __REPLAY_AD_H
+
+#include "Math.h"
+#include "FusedAD.h"
+#include <cmath>
+#include <ostream>
+#include <vector>
+
+namespace simference
+{
+	namespace AD
+	{
+		class Recorded;
+
+		// A function of several inputs that computes its own partial derivatives (in double), recorded
+		// as a single instruction. It may branch internally: it is re-run on every replay, so its
+		// branches need no guards.
+		class Kernel
+		{
+		public:
+			virtual double evaluate(unsigned int n, const double* inputs, double* partials) const = 0;
+		};
+
+		// A straight-line recording of a scalar function of some inputs, which can be replayed (forward for
+		// the value, then backward for the gradient) at new inputs without rebuilding anything.
+		// Every comparison made on recorded values is kept as a guard. If a replay flips one, the function
+		// would have taken another path at the new inputs, so the replay fails and the caller must re-record.
+		class Tape
+		{
+		public:
+			enum Op { Add = 0, Sub, Mul, Div, Neg, Exp, Log, Sqrt, Abs, Sin, Cos, Call };
+			enum Comparison { Less = 0, LessEqual, Equal };
+
+			Tape() : numInputs(0), output(0), recorded(false) {}
+
+			// Makes 'tape' the active tape for its lifetime, with 'inputs' as the tape's first slots
+			class Recording
+			{
+			public:
+				Recording(Tape& t, const std::vector<double>& inputs, std::vector<Recorded>& recordedInputs);
+				~Recording() { active() = previous; }
+				void finish(const Recorded& result);
+			private:
+				Tape& tape;
+				Tape* previous;
+			};
+
+			bool isRecorded() const { return recorded; }
+			unsigned int numInstructions() const { return instructions.size(); }
+			unsigned int numGuards() const { return guards.size(); }
+
+			// Returns false if a guard failed (in which case 'value' and 'gradient' are meaningless)
+			bool replay(const std::vector<double>& inputs, double& value, std::vector<double>& gradient);
+
+			// The tape being recorded onto, if any
+			static Tape*& active() { static Tape* tape = NULL; return tape; }
+
+			// Recording (see Recorded)
+			Recorded record(Op op, const Recorded& a, const Recorded& b, double value);
+			Recorded call(const Kernel& kernel, unsigned int n, const Recorded* xs);
+			void guard(Comparison c, const Recorded& a, const Recorded& b, bool outcome);
+
+		private:
+			class Instruction
+			{
+			public:
+				Op op;
+				unsigned int result;
+				unsigned int a, b;		// Operand slots (for Call, 'a' indexes 'calls')
+			};
+			class KernelCall
+			{
+			public:
+				const Kernel* kernel;
+				unsigned int first, count;	// Range of 'operands' (and 'partials')
+			};
+			class Guard
+			{
+			public:
+				Comparison comparison;
+				unsigned int a, b;
+				bool outcome;
+			};
+
+			unsigned int slot(const Recorded& x);
+
+			std::vector<Instruction> instructions;
+			std::vector<KernelCall> calls;
+			std::vector<Guard> guards;
+			std::vector<unsigned int> operands;
+			std::vector<double> values, partials, adjoints, scratch;
+			unsigned int numInputs, output;
+			bool recorded;
+		};
+
+		// A scalar whose operations are recorded onto the active tape. Constants, and anything computed
+		// from constants alone, aren't recorded.
+		class Recorded
+		{
+		public:
+			enum { Constant = -1 };
+			Recorded(double v = 0.0) : value(v), slot(Constant) {}
+			Recorded(double v, int s) : value(v), slot(s) {}
+			double val() const { return value; }
+			bool isConstant() const { return slot == Constant; }
+			inline Recorded& operator+=(const Recorded& b);
+			inline Recorded& operator-=(const Recorded& b);
+			inline Recorded& operator*=(const Recorded& b);
+			inline Recorded& operator/=(const Recorded& b);
+			double value;
+			int slot;
+		};
+
+		inline Recorded record(Tape::Op op, const Recorded& a, const Recorded& b, double value)
+		{
+			if (a.isConstant() && b.isConstant())
+				return Recorded(value);
+			return Tape::active()->record(op, a, b, value);
+		}
+
+		inline bool compare(Tape::Comparison c, const Recorded& a, const Recorded& b, bool outcome)
+		{
+			if (!(a.isConstant() && b.isConstant()))
+				Tape::active()->guard(c, a, b, outcome);
+			return outcome;
+		}
+
+		// A kernel applied to recorded operands
+		inline Recorded call(const Kernel& kernel, unsigned int n, const Recorded* xs)
+		{
+			bool allConstant = true;
+			for (unsigned int i = 0; i < n; i++)
+				allConstant = allConstant && xs[i].isConstant();
+			if (!allConstant)
+				return Tape::active()->call(kernel, n, xs);
+			std::vector<double> vals(n), partials(n);
+			for (unsigned int i = 0; i < n; i++)
+				vals[i] = xs[i].value;
+			return Recorded(kernel.evaluate(n, vals.data(), partials.data()));
+		}
+
+		inline Recorded operator+(const Recorded& a, const Recorded& b) { return record(Tape::Add, a, b, a.value + b.value); }
+		inline Recorded operator-(const Recorded& a, const Recorded& b) { return record(Tape::Sub, a, b, a.value - b.value); }
+		inline Recorded operator*(const Recorded& a, const Recorded& b) { return record(Tape::Mul, a, b, a.value * b.value); }
+		inline Recorded operator/(const Recorded& a, const Recorded& b) { return record(Tape::Div, a, b, a.value / b.value); }
+		inline Recorded operator-(const Recorded& a) { return record(Tape::Neg, a, a, -a.value); }
+		inline Recorded& Recorded::operator+=(const Recorded& b) { return *this = *this + b; }
+		inline Recorded& Recorded::operator-=(const Recorded& b) { return *this = *this - b; }
+		inline Recorded& Recorded::operator*=(const Recorded& b) { return *this = *this * b; }
+		inline Recorded& Recorded::operator/=(const Recorded& b) { return *this = *this / b; }
+
+		inline Recorded exp(const Recorded& a) { return record(Tape::Exp, a, a, std::exp(a.value)); }
+		inline Recorded log(const Recorded& a) { return record(Tape::Log, a, a, std::log(a.value)); }
+		inline Recorded sqrt(const Recorded& a) { return record(Tape::Sqrt, a, a, std::sqrt(a.value)); }
+		inline Recorded fabs(const Recorded& a) { return record(Tape::Abs, a, a, std::fabs(a.value)); }
+		inline Recorded abs(const Recorded& a) { return fabs(a); }
+		inline Recorded sin(const Recorded& a) { return record(Tape::Sin, a, a, std::sin(a.value)); }
+		inline Recorded cos(const Recorded& a) { return record(Tape::Cos, a, a, std::cos(a.value)); }
+
+		inline bool operator<(const Recorded& a, const Recorded& b) { return compare(Tape::Less, a, b, a.value < b.value); }
+		inline bool operator>(const Recorded& a, const Recorded& b) { return compare(Tape::Less, b, a, b.value < a.value); }
+		inline bool operator<=(const Recorded& a, const Recorded& b) { return compare(Tape::LessEqual, a, b, a.value <= b.value); }
+		inline bool operator>=(const Recorded& a, const Recorded& b) { return compare(Tape::LessEqual, b, a, b.value <= a.value); }
+		inline bool operator==(const Recorded& a, const Recorded& b) { return compare(Tape::Equal, a, b, a.value == b.value); }
+		inline bool operator!=(const Recorded& a, const Recorded& b) { return !compare(Tape::Equal, a, b, a.value == b.value); }
+
+		inline std::ostream& operator<<(std::ostream& out, const Recorded& x) { return out << x.value; }
+
+
+		//////////////////// Implementation ///////////////////////////////
+
+
+		inline Tape::Recording::Recording(Tape& t, const std::vector<double>& inputs, std::vector<Recorded>& recordedInputs)
+			: tape(t), previous(active())
+		{
+			tape.instructions.clear();
+			tape.calls.clear();
+			tape.guards.clear();
+			tape.operands.clear();
+			tape.partials.clear();
+			tape.values.assign(inputs.begin(), inputs.end());
+			tape.numInputs = inputs.size();
+			tape.recorded = false;
+			recordedInputs.clear();
+			for (unsigned int i = 0; i < inputs.size(); i++)
+				recordedInputs.push_back(Recorded(inputs[i], i));
+			active() = &tape;
+		}
+
+		inline void Tape::Recording::finish(const Recorded& result)
+		{
+			tape.output = tape.slot(result);
+			tape.adjoints.resize(tape.values.size());
+			tape.recorded = true;
+		}
+
+		// Constants get a slot of their own the first time they meet a recorded value
+		inline unsigned int Tape::slot(const Recorded& x)
+		{
+			if (!x.isConstant())
+				return x.slot;
+			values.push_back(x.value);
+			return values.size() - 1;
+		}
+
+		inline Recorded Tape::record(Op op, const Recorded& a, const Recorded& b, double value)
+		{
+			Instruction ins;
+			ins.op = op;
+			ins.a = slot(a);
+			ins.b = (&a == &b ? ins.a : slot(b));
+			ins.result = values.size();
+			values.push_back(value);
+			instructions.push_back(ins);
+			return Recorded(value, ins.result);
+		}
+
+		inline Recorded Tape::call(const Kernel& kernel, unsigned int n, const Recorded* xs)
+		{
+			KernelCall c;
+			c.kernel = &kernel;
+			c.first = operands.size();
+			c.count = n;
+			for (unsigned int i = 0; i < n; i++)
+				operands.push_back(slot(xs[i]));
+			partials.resize(operands.size());
+			if (scratch.size() < n)
+				scratch.resize(n);
+			for (unsigned int i = 0; i < n; i++)
+				scratch[i] = values[operands[c.first + i]];
+			double value = kernel.evaluate(n, scratch.data(), &partials[c.first]);
+
+			Instruction ins;
+			ins.op = Call;
+			ins.a = calls.size();
+			ins.b = 0;
+			ins.result = values.size();
+			calls.push_back(c);
+			values.push_back(value);
+			instructions.push_back(ins);
+			return Recorded(value, ins.result);
+		}
+
+		inline void Tape::guard(Comparison c, const Recorded& a, const Recorded& b, bool outcome)
+		{
+			Guard g;
+			g.comparison = c;
+			g.a = slot(a);
+			g.b = slot(b);
+			g.outcome = outcome;
+			guards.push_back(g);
+		}
+
+		inline bool Tape::replay(const std::vector<double>& inputs, double& value, std::vector<double>& gradient)
+		{
+			double* v = values.data();
+			for (unsigned int i = 0; i < numInputs; i++)
+				v[i] = inputs[i];
+
+			// Forward
+			unsigned int n = instructions.size();
+			for (unsigned int i = 0; i < n; i++)
+			{
+				const Instruction& ins = instructions[i];
+				switch (ins.op)
+				{
+				case Add: v[ins.result] = v[ins.a] + v[ins.b]; break;
+				case Sub: v[ins.result] = v[ins.a] - v[ins.b]; break;
+				case Mul: v[ins.result] = v[ins.a] * v[ins.b]; break;
+				case Div: v[ins.result] = v[ins.a] / v[ins.b]; break;
+				case Neg: v[ins.result] = -v[ins.a]; break;
+				case Exp: v[ins.result] = std::exp(v[ins.a]); break;
+				case Log: v[ins.result] = std::log(v[ins.a]); break;
+				case Sqrt: v[ins.result] = std::sqrt(v[ins.a]); break;
+				case Abs: v[ins.result] = std::fabs(v[ins.a]); break;
+				case Sin: v[ins.result] = std::sin(v[ins.a]); break;
+				case Cos: v[ins.result] = std::cos(v[ins.a]); break;
+				case Call:
+					{
+						const KernelCall& c = calls[ins.a];
+						for (unsigned int k = 0; k < c.count; k++)
+							scratch[k] = v[operands[c.first + k]];
+						v[ins.result] = c.kernel->evaluate(c.count, scratch.data(), &partials[c.first]);
+					}
+					break;
+				}
+			}
+
+			// The recording is only good for these inputs if every branch went the same way
+			for (const auto& g : guards)
+			{
+				bool outcome;
+				switch (g.comparison)
+				{
+				case Less: outcome = v[g.a] < v[g.b]; break;
+				case LessEqual: outcome = v[g.a] <= v[g.b]; break;
+				default: outcome = v[g.a] == v[g.b]; break;
+				}
+				if (outcome != g.outcome)
+					return false;
+			}
+
+			// Backward
+			double* adj = adjoints.data();
+			std::fill(adjoints.begin(), adjoints.end(), 0.0);
+			adj[output] = 1.0;
+			for (int i = (int)n-1; i >= 0; i--)
+			{
+				const Instruction& ins = instructions[i];
+				double d = adj[ins.result];
+				switch (ins.op)
+				{
+				case Add: adj[ins.a] += d; adj[ins.b] += d; break;
+				case Sub: adj[ins.a] += d; adj[ins.b] -= d; break;
+				case Mul: adj[ins.a] += d * v[ins.b]; adj[ins.b] += d * v[ins.a]; break;
+				case Div: adj[ins.a] += d / v[ins.b]; adj[ins.b] -= d * v[ins.result] / v[ins.b]; break;
+				case Neg: adj[ins.a] -= d; break;
+				case Exp: adj[ins.a] += d * v[ins.result]; break;
+				case Log: adj[ins.a] += d / v[ins.a]; break;
+				case Sqrt: adj[ins.a] += d * 0.5 / v[ins.result]; break;
+				case Abs: adj[ins.a] += (v[ins.a] > 0.0 ? d : (v[ins.a] < 0.0 ? -d : 0.0)); break;
+				case Sin: adj[ins.a] += d * std::cos(v[ins.a]); break;
+				case Cos: adj[ins.a] -= d * std::sin(v[ins.a]); break;
+				case Call:
+					{
+						const KernelCall& c = calls[ins.a];
+						for (unsigned int k = 0; k < c.count; k++)
+							adj[operands[c.first + k]] += d * partials[c.first + k];
+					}
+					break;
+				}
+			}
+
+			value = v[output];
+			gradient.assign(adjoints.begin(), adjoints.begin() + numInputs);
+			return true;
+		}
+	}
+
+	// Plain value of a recorded scalar (reading it this way doesn't guard anything)
+	inline double valueOf(const AD::Recorded& x) { return x.val(); }
+
+	namespace Math
+	{
+		// Math::softMax for recorded scalars, recorded as one kernel call
+		inline AD::Recorded softMax(const std::vector<AD::Recorded>& nums, double alpha)
+		{
+			class SoftMaxKernel : public AD::Kernel
+			{
+			public:
+				// The last input is alpha
+				double evaluate(unsigned int n, const double* inputs, double* partials) const
+				{
+					partials[n-1] = 0.0;
+					return softMax(inputs, n-1, inputs[n-1], partials);
+				}
+			};
+			static SoftMaxKernel kernel;
+			std::vector<AD::Recorded> inputs(nums);
+			inputs.push_back(alpha);
+			return AD::call(kernel, inputs.size(), inputs.data());
+		}
+	}
+}
+
+#endif
@@ -102,8 +102,8 @@ namespace simference
 
 		void DiffusionSampler::reinitialize(StructurePtr s, Model& m, const vector<double>& initParams)
 		{
-			// This feels so dirty, but it covers up a bug that I haven't been able to track down...
-			stan::agrad::recover_memory();
+			// Whatever the new sampler puts on the tape while setting itself up goes when it's done
+			AD::EvaluationScope scope;
 
 			structure = s;
 			auto oldimpl = implementation;
@@ -111,8 +111,6 @@ namespace simference
 			delete oldimpl;
 			prevParams = initParams;
 			numMovesAttempted = numMovesAccepted = 0;
-
-			stan::agrad::recover_memory();
 		}
 
 		bool DiffusionSampler::paramsEqual(const std::vector<double>& p1, const std::vector<double>& p2)
@@ -177,8 +175,25 @@ namespace simference
 			numJumpMovesAttempted(0), numJumpMovesAccepted(0), numDiffDimJumpMovesAccepted(0),
 			numAnnealingMovesAttempted(0), numAnnealingMovesAccepted(0)
 		{
-			currentUnrolledModel = templateModel->unroll(initStruct);
+			currentUnrolledModel = unrollAt(initStruct, initParams);
 			innerSampler = DiffusionSamplerPtr(new DiffusionSampler(initStruct, *currentUnrolledModel, initParams));
+			recordVisit(initStruct);
+		}
+
+		ModelPtr JumpSampler::unrollAt(StructurePtr s, const vector<double>& params)
+		{
+			// Unrolling may read the structure's parameters. Any vars it still holds went with the last
+			// rewind of the tape, so they are re-seated from plain values first (see AD::EvaluationScope).
+			AD::EvaluationScope scope;
+			vector<stan::agrad::var> p(params.begin(), params.end());
+			s->bindParams(ParameterVector<stan::agrad::var>(p));
+			return templateModel->unroll(s);
+		}
+
+		void JumpSampler::recordVisit(StructurePtr s)
+		{
+			visitedStructures.insert(s->structuralHash());
+			visitedMirrorStructures.insert(s->mirrorStructuralHash());
 		}
 
 		Sample JumpSampler::nextSample()
@@ -218,16 +233,19 @@ namespace simference
 		{
 			numJumpMovesAttempted++;
 
-			double currLp = currentUnrolledModel->log_prob(currentParams);
-
 			// Propose new structure and do dimension matching
 			DimensionMatchMap dimMatchMap;
 			std::vector<double> extendedParams;
-			StructurePtr newStruct = jumpProposal(extendedParams, dimMatchMap);
-
-			// Unroll factors for the current structure and new structure
+			StructurePtr newStruct;
 			ModelPtr currModel, newModel, sharedModel;
-			templateModel->unroll(currentStruct, newStruct, dimMatchMap, currModel, newModel, sharedModel);
+			{
+				// Proposing and unrolling read and write the trees' parameters through the tape
+				AD::EvaluationScope scope;
+				newStruct = jumpProposal(extendedParams, dimMatchMap);
+
+				// Unroll factors for the current structure and new structure
+				templateModel->unroll(currentStruct, newStruct, dimMatchMap, currModel, newModel, sharedModel);
+			}
 			vector<ModelPtr> models;
 			models.push_back(currModel);	// 0
 			models.push_back(newModel);		// 1
@@ -243,7 +261,16 @@ namespace simference
 			// Run the inner HMC kernel for numAnnealingSteps
 			// Adjust the temperature of the factors each step
 			// Accumulate probability ratio as we go
+			// (We keep the per-component log probs of the current annealing state around, so the
+			//  ratio at each step is just a reweighting of cached values. The model only needs to be
+			//  evaluated again when the inner sampler actually moves.)
 			annealingSamples.clear();
+			vector<double> componentLps, nextComponentLps;
+			mixModel->componentLogProbs(extendedParams, componentLps);
+
+			// At the start, the mixture is just the old model (over the extended parameters, of which it
+			// ignores the new subtree's), so the current log prob needs no evaluation of its own
+			double currLp = mixModel->combineComponents(componentLps);
 			annealingSamples.push_back(Sample(newStruct, extendedParams, currLp, Sample::JumpBegin, true));
 			double annealingLpRatio = 0.0;
 			for (unsigned int i = 0; i < numAnnealingSteps; i++)
@@ -258,18 +285,19 @@ namespace simference
 				unsigned int currNumAccept = innerSampler->numMovesAccepted;
 				samp.proposalType = Sample::Annealing;
 				if (currNumAccept == prevNumAccept)
-				{
-					// If we rejected this proposal, we need to re-compute its log probability, since
-					// the fixed-dimension inner sampler will give us the last accepted probability, which is
-					// outdated due to annealing interpolation.
-					samp.logprob = currentUnrolledModel->log_prob(samp.params);
-				}
+					nextComponentLps = componentLps;
+				else
+					mixModel->componentLogProbs(samp.params, nextComponentLps);
 
-				vector<double>& xt = annealingSamples.back().params;
-				double lpt = currentUnrolledModel->log_prob(xt);
+				// If we rejected this proposal, the fixed-dimension inner sampler gives us the last accepted
+				// probability, which is outdated due to annealing interpolation; reweighting fixes that, too.
+				samp.logprob = mixModel->combineComponents(nextComponentLps);
+
+				double lpt = mixModel->combineComponents(componentLps);
 				double lptplus1 = samp.logprob;
 				annealingLpRatio += (lpt - lptplus1);
 
+				componentLps.swap(nextComponentLps);
 				annealingSamples.push_back(samp);
 			}
 			numAnnealingMovesAttempted += innerSampler->numMovesAttempted;
@@ -279,7 +307,7 @@ namespace simference
 			weights[1] = 1.0;
 			weights[2] = 1.0;
 			vector<double>& propParams = annealingSamples.back().params;
-			double propLp = currentUnrolledModel->log_prob(propParams);
+			double propLp = mixModel->combineComponents(componentLps);
 
 			// Accept or reject the new structure
 			double forwardInitProposalLp, reverseInitProposalLp;
@@ -297,6 +325,7 @@ namespace simference
 				currLp = propLp;
 				numJumpMovesAccepted++;
 				jumpAccepted = true;
+				recordVisit(currentStruct);
 			}
 
 			//// TEST: While we're debugging, just force acceptance for all jumps
@@ -308,7 +337,7 @@ namespace simference
 			//if (!currentStruct->structurallyEquivalentTo(newStruct))
 			//	numDiffDimJumpMovesAccepted++;
 
-			currentUnrolledModel = templateModel->unroll(currentStruct);
+			currentUnrolledModel = unrollAt(currentStruct, currentParams);
 			innerSampler->reinitialize(currentStruct, *currentUnrolledModel, currentParams);
 
 			// Translate the parameters of all the annealing samples so we can analyze/visualize them later
@@ -429,6 +458,12 @@ namespace simference
 			out << "	Percentage:      " << ((double)numJumpMovesAccepted)/numJumpMovesAttempted << endl;
 			out << "	Accepted Diff Struct Moves:  " << numDiffDimJumpMovesAccepted << endl;
 			out << "	Percentage:      " << ((double)numDiffDimJumpMovesAccepted)/numJumpMovesAttempted << endl;
+			out << "	Distinct Structures Visited: " << visitedStructures.size() << endl;
+			out << "	  (Up To Mirror Symmetry):   " << visitedMirrorStructures.size() << endl;
+			out << "-----------------------------------------------" << endl;
+			out << " Tape Stats:" << endl;
+			out << "	Peak Bytes: " << AD::EvaluationScope::peakTapeBytes() << endl;
+			out << "	Peak Nodes: " << AD::EvaluationScope::peakTapeNodes() << endl;
 			out << "-----------------------------------------------" << endl;
 			out << endl;
 		}
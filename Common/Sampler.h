@@ -3,6 +3,7 @@
 
 #include "Model.h"
 #include "Distributions.h"
+#include <unordered_set>
 
 namespace simference
 {
@@ -118,6 +119,7 @@ namespace simference
 			double diffusionAcceptanceRatio() { return ((double)numDiffusionMovesAccepted)/numDiffusionMovesAttempted; }
 			double annealingAcceptanceRatio() { return ((double)numAnnealingMovesAccepted)/numAnnealingMovesAttempted; }
 			double jumpAcceptanceRatio() { return ((double)numJumpMovesAccepted)/numJumpMovesAttempted; }
+			unsigned int numStructuresVisited() { return visitedStructures.size(); }
 
 		protected:
 
@@ -127,6 +129,7 @@ namespace simference
 				StructurePtr sTo, const std::vector<double>& pTo) = 0;
 
 			Sample executeJumpMove();
+			Models::ModelPtr unrollAt(StructurePtr s, const std::vector<double>& params);
 
 			DiffusionSamplerPtr innerSampler;
 			Models::FactorTemplateModelPtr templateModel;
@@ -145,6 +148,9 @@ namespace simference
 			unsigned int numAnnealingMovesAttempted;
 			unsigned int numAnnealingMovesAccepted;
 			std::vector<Sample> annealingSamples;
+			std::unordered_set<uint64_t> visitedStructures;
+			std::unordered_set<uint64_t> visitedMirrorStructures;
+			void recordVisit(StructurePtr s);
 		};
 	}
 }